@@ -0,0 +1,217 @@
+/*
+ * Directory listings: creates directories of the given sizes and times
+ *  - the bare scan, readdir() + stat() of a path per entry against
+ *    getdents64() + statx() relative to the directory fd;
+ *  - the whole listing as the server builds it, get_dir() plus the
+ *    html page, rendered in one piece or streamed.
+ * Each figure is the best of a few runs.
+ *
+ * usage: dirscan [ -r runs ] entries ...
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "httpd.h"
+
+#define DENTS_SIZE (64 * 1024)
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fill >dir< with n empty files */
+static void mkentries(char *dir, long n)
+{
+    char name[MAX_PATH + 1];
+    long i;
+    int fd;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s/file-%07ld.dat", dir, i);
+        if (-1 == (fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644))) {
+            fprintf(stderr, "create %s: %s\n", name, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+static void rmentries(char *dir, long n)
+{
+    char name[MAX_PATH + 1];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s/file-%07ld.dat", dir, i);
+        unlink(name);
+    }
+    rmdir(dir);
+}
+
+/* how ls() used to do it */
+static long scan_readdir(char *dir)
+{
+    char path[MAX_PATH + 1];
+    struct dirent *file;
+    struct stat st;
+    DIR *d;
+    long n = 0;
+
+    if (NULL == (d = opendir(dir)))
+        return -1;
+    while (NULL != (file = readdir(d))) {
+        snprintf(path, sizeof(path), "%s/%s", dir, file->d_name);
+        if (0 == stat(path, &st))
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+/* how scan_dir() does it, without the helper threads */
+static long scan_getdents(char *dir)
+{
+    struct dirent64 *file;
+    struct statx stx;
+    char *dents;
+    long n = 0, len, off;
+    int dfd;
+
+    if (-1 == (dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+        return -1;
+    dents = malloc(DENTS_SIZE);
+    while ((len = syscall(SYS_getdents64, dfd, dents, DENTS_SIZE)) > 0) {
+        for (off = 0; off < len; off += file->d_reclen) {
+            file = (struct dirent64 *)(dents + off);
+            if (0 == statx(dfd, file->d_name, AT_NO_AUTOMOUNT,
+                           STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+                           STATX_SIZE | STATX_MTIME, &stx))
+                n++;
+        }
+    }
+    free(dents);
+    close(dfd);
+    return n;
+}
+
+/* get_dir() and the complete html page, returns its size */
+static off_t listing(struct POOL *pool, char *dir)
+{
+    struct REQUEST *req;
+    off_t bytes = 0, len;
+    char *buf;
+    int length;
+
+    req = pool_get(pool);
+    pool_attach(pool, req);
+    req->major = 1;
+    req->minor = 1;
+    strcpy(req->hostname, "localhost");
+    strcpy(req->path, "/dir/");
+
+    if (NULL == (req->dir = get_dir(req, dir))) {
+        fprintf(stderr, "get_dir %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    if (NULL != (req->body = get_dir_body(req, &length))) {
+        bytes = length;
+    } else if (0 == open_stream(req)) {
+        do {
+            len = next_stream(req, &buf);
+            req->written += len;
+            bytes += len;
+        } while (!stream_done(req));
+        close_stream(req);
+    }
+
+    free_dir(req->dir);
+    req->dir = NULL;
+    req->body = NULL;
+    flush_dirs();
+    pool_detach(pool, req);
+    pool_put(pool, req);
+    return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    char root[] = "/tmp/gx-bench.XXXXXX";
+    struct POOL pool;
+    double t, best[3];
+    long n, count[2];
+    off_t bytes = 0;
+    int c, i, k, runs = 3;
+
+    while (-1 != (c = getopt(argc, argv, "r:"))) {
+        switch (c) {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: dirscan [ -r runs ] entries ...\n");
+            exit(1);
+        }
+    }
+    if (optind == argc || runs < 1) {
+        fprintf(stderr, "usage: dirscan [ -r runs ] entries ...\n");
+        exit(1);
+    }
+
+    now = time(NULL);
+    max_dircache = (off_t)1 << 40;
+    init_quote();
+    init_mime("/etc/mime.types", "application/octet-stream");
+    init_dircache();
+    memset(&pool, 0, sizeof(pool));
+
+    for (; optind < argc; optind++) {
+        if ((n = atol(argv[optind])) < 1 || NULL == mkdtemp(strcpy(root, "/tmp/gx-bench.XXXXXX"))) {
+            fprintf(stderr, "%s: bad size or no temporary directory\n", argv[optind]);
+            exit(1);
+        }
+        mkentries(root, n);
+        doc_root = root;
+
+        for (k = 0; k < 3; k++)
+            best[k] = 1e9;
+        for (i = 0; i < runs; i++) {
+            t = seconds();
+            count[0] = scan_readdir(root);
+            if ((t = seconds() - t) < best[0])
+                best[0] = t;
+
+            t = seconds();
+            count[1] = scan_getdents(root);
+            if ((t = seconds() - t) < best[1])
+                best[1] = t;
+
+            t = seconds();
+            bytes = listing(&pool, root);
+            if ((t = seconds() - t) < best[2])
+                best[2] = t;
+        }
+        rmentries(root, n);
+
+        if (count[0] != count[1]) {
+            fprintf(stderr, "%ld entries: scans disagree, %ld vs %ld\n", n, count[0], count[1]);
+            exit(1);
+        }
+        printf("dirscan: %7ld entries: readdir+stat %8.1f ms, getdents64+statx %8.1f ms, "
+               "listing %8.1f ms (%lld bytes)\n",
+               n, best[0] * 1e3, best[1] * 1e3, best[2] * 1e3, (long long)bytes);
+    }
+    return 0;
+}
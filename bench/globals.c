@@ -0,0 +1,35 @@
+/*
+ * The settings main.c normally owns, with its defaults, so the
+ * benchmarks can link the server objects without main.o.
+ */
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+char *server_name   = "gx-0.01";
+
+int  timeout        = 60;
+int  keepalive_time = 5;
+int  tcp_port       = 0;
+int  max_ranges     = 16;
+int  max_filecache  = 256;
+off_t max_memfile   = 16384;
+off_t max_memcache  = 32 * 1024 * 1024;
+off_t max_dircache  = 8 * 1024 * 1024;
+int  gzip_level     = 0;
+int  gzip_min       = 1024;
+int  gzip_budget    = 100;
+int  max_conn       = 0;
+int  nthreads       = 4;
+int  reuseport      = 0;
+int  use_uring      = 0;
+int  use_inotify    = 0;
+char *doc_root      = ".";
+char *mime_file     = "/etc/mime.types";
+char *listen_ip     = NULL;
+char *listen_port   = "8000";
+char user[17];
+char group[17];
+
+time_t  now;
+int     slisten;
@@ -0,0 +1,131 @@
+/*
+ * Response header cost: mkheader() for a small cached file, as a 200
+ * (the precomputed template), a 304 and a single-range 206.
+ *
+ * usage: header [ -n headers ] [ -v ]
+ *   -v prints each header once, to compare two builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a 6-byte text file in a fresh document root */
+static char *mkfile(char *root)
+{
+    static char filename[MAX_PATH + 1];
+    int fd;
+
+    if (NULL == mkdtemp(root)) {
+        fprintf(stderr, "mkdtemp %s: %s\n", root, strerror(errno));
+        exit(1);
+    }
+    snprintf(filename, sizeof(filename), "%s/hello.txt", root);
+    if (-1 == (fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) ||
+        6 != write(fd, "hello\n", 6)) {
+        fprintf(stderr, "create %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    return filename;
+}
+
+static void setup(struct REQUEST *req, struct FILECACHE *f, int status)
+{
+    req->file   = f;
+    req->mime   = f->mime;
+    req->policy = f->policy;
+    req->bfd    = f->fd;
+    *req->bst   = f->st;
+    strcpy(req->mtime, f->mtime);
+    strcpy(req->etag, f->etag);
+    req->keep_alive = 1;
+    req->major = 1;
+    req->minor = 1;
+    req->ranges = 0;
+    req->body = NULL;
+
+    if (206 == status) {
+        pool_ranges(req, 1, 0);
+        req->ranges = 1;
+        req->r_start[0] = 1;
+        req->r_end[0] = 4;
+    } else if (200 == status) {
+        req->body = f->data;
+        req->lbody = f->st.st_size;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static int status[] = { 200, 304, 206 };
+    char root[] = "/tmp/gx-bench.XXXXXX", *filename;
+    struct POOL pool;
+    struct REQUEST *req;
+    struct FILECACHE *f;
+    long i, n = 5000000;
+    int c, k, verbose = 0;
+    double t;
+
+    while (-1 != (c = getopt(argc, argv, "n:v"))) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: header [ -n headers ] [ -v ]\n");
+            exit(1);
+        }
+    }
+    if (n < 1) {
+        fprintf(stderr, "usage: header [ -n headers ] [ -v ]\n");
+        exit(1);
+    }
+
+    now = time(NULL);
+    filename = mkfile(root);
+    doc_root = root;
+    init_mime("/etc/mime.types", "application/octet-stream");
+    f = get_file(filename);
+    unlink(filename);
+    rmdir(root);
+    if (NULL == f) {
+        fprintf(stderr, "get_file %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    req = pool_get(&pool);
+    pool_attach(&pool, req);
+
+    for (k = 0; k < sizeof(status) / sizeof(status[0]); k++) {
+        setup(req, f, status[k]);
+        mkheader(req, status[k]);
+        if (verbose)
+            printf("%.*s", req->lres, req->hres);
+
+        t = seconds();
+        for (i = 0; i < n; i++)
+            mkheader(req, status[k]);
+        t = seconds() - t;
+        printf("header: %d: %5.1f ns/header\n", status[k], t / n * 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Mime type lookup: get_mime() over a handful of typical paths, with
+ * a mime.types file loaded.
+ *
+ * usage: mime [ -n lookups ] [ -v ] [ mime.types ]
+ *   -v prints the type found for each path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+static char *paths[] = {
+    "./pub/index.html",
+    "./static/app.js",
+    "./photos/IMG_0042.JPG",
+    "./pub/linux-6.8.tar.xz",
+    "./pub/README",
+    "./data/dump.unknownext",
+    "./static/style.css",
+    "./video/talk.mp4",
+};
+
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    char *file = "/etc/mime.types";
+    char *volatile type;
+    long i, n = 10000000;
+    int c, verbose = 0;
+    double t;
+
+    while (-1 != (c = getopt(argc, argv, "n:v"))) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: mime [ -n lookups ] [ -v ] [ mime.types ]\n");
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        file = argv[optind];
+    if (n < 1) {
+        fprintf(stderr, "usage: mime [ -n lookups ] [ -v ] [ mime.types ]\n");
+        exit(1);
+    }
+
+    init_mime(file, "application/octet-stream");
+    if (verbose)
+        for (i = 0; i < NPATHS; i++)
+            printf("%s: %s\n", paths[i], get_mime(paths[i]));
+
+    t = seconds();
+    for (i = 0; i < n; i++)
+        type = get_mime(paths[i % NPATHS]);
+    t = seconds() - t;
+    (void)type;
+    printf("mime: %5.1f ns/lookup\n", t / n * 1e9);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Request parser throughput: feeds recorded request headers through
+ * scan_request() and parse_request() in reads of 4096, 64, 8 and 1
+ * bytes, the way the event loops hand them over.
+ *
+ * The file cache is stubbed out (every file is missing), so this
+ * times the parser and the error response, not the filesystem.
+ *
+ * usage: parse [ -n requests ] [ -v ] file.http ...
+ *   -v prints each response header once, to compare two builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+#define MAX_CORPUS 64
+
+static char *corpus[MAX_CORPUS];
+static int  lcorpus[MAX_CORPUS];
+static int  ncorpus;
+
+/* ---------------------------------------------------------------------- */
+/* file cache stubs                                                       */
+
+struct FILECACHE *get_file(char *filename)
+{
+    errno = ENOENT;
+    return NULL;
+}
+
+int probe_file(char *filename, struct stat *st, int *variants)
+{
+    errno = ENOENT;
+    return -1;
+}
+
+void free_file(struct FILECACHE *file) {}
+char *get_file_gz(struct FILECACHE *file, int *length) { return NULL; }
+void file_changed(char *path) {}
+void flush_files(void) {}
+
+unsigned int hash_path(char *path)
+{
+    unsigned int hash = 5381;
+
+    while (*path)
+        hash = hash * 33 + (unsigned char)*path++;
+    return hash;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load(char *filename)
+{
+    FILE *fp;
+    char *buf;
+    int len;
+
+    if (MAX_CORPUS == ncorpus) {
+        fprintf(stderr, "%s: too many files\n", filename);
+        exit(1);
+    }
+    if (NULL == (fp = fopen(filename, "r"))) {
+        fprintf(stderr, "open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    buf = malloc(MAX_HEADER + 1);
+    len = fread(buf, 1, MAX_HEADER + 1, fp);
+    fclose(fp);
+    if (len > MAX_HEADER)
+        len = 0;
+    buf[len] = 0;
+    if (NULL == strstr(buf, "\r\n\r\n")) {
+        fprintf(stderr, "%s: not a complete request header\n", filename);
+        exit(1);
+    }
+    corpus[ncorpus] = buf;
+    lcorpus[ncorpus++] = len;
+}
+
+/* parse corpus[i] arriving in reads of chunk bytes */
+static void run(struct POOL *pool, int i, int chunk, int verbose)
+{
+    struct REQUEST *req;
+    int off, len;
+
+    req = pool_get(pool);
+    pool_attach(pool, req);
+    req->state = STATE_READ_HEADER;
+    for (off = 0; off < lcorpus[i] && STATE_READ_HEADER == req->state; off += len) {
+        len = lcorpus[i] - off < chunk ? lcorpus[i] - off : chunk;
+        memcpy(req->hreq + req->hdata, corpus[i] + off, len);
+        req->hdata += len;
+        req->hreq[req->hdata] = 0;
+        scan_request(req);
+    }
+    if (STATE_PARSE_HEADER == req->state)
+        parse_request(req);
+    if (verbose)
+        printf("%.*s", req->lres, req->hres);
+    pool_detach(pool, req);
+    pool_put(pool, req);
+}
+
+int main(int argc, char *argv[])
+{
+    static int chunks[] = { 4096, 64, 8, 1 };
+    struct POOL pool;
+    long i, n = 200000, bytes;
+    int c, k, verbose = 0;
+    double t;
+
+    while (-1 != (c = getopt(argc, argv, "n:v"))) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: parse [ -n requests ] [ -v ] file.http ...\n");
+            exit(1);
+        }
+    }
+    for (; optind < argc; optind++)
+        load(argv[optind]);
+    if (0 == ncorpus || n < 1) {
+        fprintf(stderr, "usage: parse [ -n requests ] [ -v ] file.http ...\n");
+        exit(1);
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    now = time(NULL);
+    if (verbose)
+        for (i = 0; i < ncorpus; i++)
+            run(&pool, i, MAX_HEADER, 1);
+
+    for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+        bytes = 0;
+        t = seconds();
+        for (i = 0; i < n; i++) {
+            run(&pool, i % ncorpus, chunks[k], 0);
+            bytes += lcorpus[i % ncorpus];
+        }
+        t = seconds() - t;
+        printf("parse: %4d-byte reads: %6.0f ns/request, %5.0f MB/s\n",
+               chunks[k], t / n * 1e9, bytes / t / 1e6);
+    }
+    return 0;
+}
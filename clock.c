@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+/*
+ * Formatted time for response headers and log lines.  Every thread keeps
+ * its own copy and only reformats when the second changes, so building
+ * a response doesn't run strftime() and nobody shares a static buffer.
+ */
+
+struct CLOCK {
+    time_t  date_sec;
+    int     date_len;
+    char    date[64];               /* "Date: ...\r\n\r\n" */
+    time_t  exp_sec;
+    int     exp_len;
+    char    exp[64];                /* "Expires: ...\r\n" */
+    time_t  log_sec;
+    char    log[32];                /* "%F %T", local time */
+};
+
+static __thread struct CLOCK clk = { -1, 0, "", -1, 0, "", -1, "" };
+
+/* the final header line for >now<, returns its length */
+int date_header(char *buf)
+{
+    struct tm tm;
+
+    if (clk.date_sec != now) {
+        clk.date_sec = now;
+        clk.date_len = strftime(clk.date, sizeof(clk.date),
+                                "Date: " RFC1123 "\r\n\r\n", gmtime_r(&now, &tm));
+    }
+
+    memcpy(buf, clk.date, clk.date_len);
+    return clk.date_len;
+}
+
+/* Expires line for >maxage< seconds from now, returns its length */
+int expires_header(char *buf, int maxage)
+{
+    struct tm tm;
+    time_t t = now + maxage;
+
+    if (clk.exp_sec != t) {
+        clk.exp_sec = t;
+        clk.exp_len = strftime(clk.exp, sizeof(clk.exp),
+                               "Expires: " RFC1123 "\r\n", gmtime_r(&t, &tm));
+    }
+
+    memcpy(buf, clk.exp, clk.exp_len);
+    return clk.exp_len;
+}
+
+/* timestamp for log lines */
+char *get_time(void)
+{
+    struct tm tm;
+    time_t t = time(NULL);
+
+    if (clk.log_sec != t) {
+        clk.log_sec = t;
+        strftime(clk.log, sizeof(clk.log), "%F %T", localtime_r(&t, &tm));
+    }
+
+    return clk.log;
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+#define FC_BUCKETS  1024            /* hash buckets, power of two */
+
+/*
+ * Open regular files, shared by all workers.  An entry keeps the fd, the
+ * stat info, the formatted mtime and the mime type of a file, keyed by
+ * the path it was opened with.  Requests take a reference while they
+ * send the file (the fd is only used with explicit offsets, so sharing
+ * it is fine); the cache holds one more as long as the entry is listed.
+ * The entry also carries the Content-Type/Length, Last-Modified and ETag
+ * header lines for the complete file, ready to be copied into a response,
+ * and its caching policy.
+ * Entries are revalidated with stat() at most once a second and dropped
+ * when inode, size or mtime changed.  Entries opened while their directory
+ * was watched (see watch.c) skip that, they are dropped when a change is
+ * reported instead.  Beyond max_filecache entries the
+ * least recently used one is evicted.
+ *
+ * The entry also remembers which precompressed sidecars (foo.gz, foo.br)
+ * exist and are at least as new as the file, checked along with it, so
+ * content negotiation costs no extra syscalls.
+ *
+ * Files up to max_memfile bytes are read into the entry as well and sent
+ * from memory like a directory listing.  Their total size is capped at
+ * max_memcache bytes, again evicting the least recently used entries.
+ * With -z their gzip'ed variant is kept (and accounted for) too.
+ */
+
+static pthread_mutex_t lock_filecache = PTHREAD_MUTEX_INITIALIZER;
+
+static struct FILECACHE *files[FC_BUCKETS];
+static struct FILECACHE *lru_head, *lru_tail;      /* most recent first */
+static int              nfiles, nmem;
+static off_t            membytes;
+static unsigned long    hits, misses, stale, invalidated;
+
+unsigned int hash_path(char *path)
+{
+    unsigned int h = 2166136261u;
+
+    for (; *path; path++) {
+        h = (h ^ (unsigned char) * path) * 16777619u;
+    }
+
+    return h;
+}
+
+static int same_file(struct stat *a, struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+           a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* --- everything below with lock_filecache held ------------------------ */
+
+static struct FILECACHE *lookup(char *path, unsigned int hash)
+{
+    struct FILECACHE *f;
+
+    for (f = files[hash & (FC_BUCKETS - 1)]; NULL != f; f = f->hnext) {
+        if (f->hash == hash && 0 == strcmp(f->path, path)) {
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+static void lru_unlink(struct FILECACHE *f)
+{
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        lru_head = f->next;
+    }
+
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        lru_tail = f->prev;
+    }
+}
+
+static void lru_push(struct FILECACHE *f)
+{
+    f->prev = NULL;
+    f->next = lru_head;
+
+    if (lru_head) {
+        lru_head->prev = f;
+    } else {
+        lru_tail = f;
+    }
+
+    lru_head = f;
+}
+
+static void release(struct FILECACHE *f)
+{
+    if (--f->refcount > 0) {
+        return;
+    }
+
+    close(f->fd);
+    free(f->gz);
+    free(f);
+}
+
+/* take f out of the cache, it lives on until the last request is done */
+static void drop(struct FILECACHE *f)
+{
+    struct FILECACHE **p;
+
+    for (p = &files[f->hash & (FC_BUCKETS - 1)]; *p != f; p = &(*p)->hnext)
+        ;
+
+    *p = f->hnext;
+    lru_unlink(f);
+    nfiles--;
+
+    if (f->data) {
+        nmem--;
+        membytes -= f->st.st_size + (f->gzlength > 0 ? f->gzlength : 0);
+    }
+
+    release(f);
+}
+
+/* evict from the lru tail until >bytes< more fit into max_memcache, f stays */
+static void trim_mem(struct FILECACHE *f, off_t bytes)
+{
+    while (membytes + bytes > max_memcache && lru_tail != f) {
+        drop(lru_tail);
+    }
+}
+
+/* --------------------------------------------------------------------- */
+
+/* watch the directory of >filename<, 0 if its changes get reported */
+static int watch_parent(char *filename)
+{
+    char dir[MAX_PATH + 1], *slash;
+    int  len;
+
+    if (NULL == (slash = strrchr(filename, '/')) || (len = slash + 1 - filename) > MAX_PATH) {
+        return -1;
+    }
+
+    memcpy(dir, filename, len);
+    dir[len] = 0;
+    return watch_dir(dir);
+}
+
+/* ENC_* mask of the sidecars of >filename< which are fresh */
+static int sidecars(char *filename, struct stat *orig)
+{
+    static const struct {
+        int  enc;
+        char *ext;
+    } side[] = {
+        { ENC_GZIP, ".gz" },
+        { ENC_BR,   ".br" },
+    };
+    char path[MAX_PATH + 8], *ext;
+    struct stat st;
+    int i, len, mask = 0;
+
+    len = strlen(filename);
+    ext = strrchr(filename, '.');
+
+    if (len + 4 > sizeof(path) ||
+        (NULL != ext && (0 == strcmp(ext, ".gz") || 0 == strcmp(ext, ".br")))) {
+        /* no sidecars of sidecars */
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(side) / sizeof(side[0]); i++) {
+        memcpy(path, filename, len);
+        strcpy(path + len, side[i].ext);
+
+        if (0 == stat(path, &st) && S_ISREG(st.st_mode) &&
+            st.st_mtime >= orig->st_mtime) {
+            mask |= side[i].enc;
+        }
+    }
+
+    return mask;
+}
+
+/* read a small file completely, 0 on success */
+static int load(struct FILECACHE *f)
+{
+    off_t   off;
+    ssize_t rc;
+
+    for (off = 0; off < f->st.st_size; off += rc) {
+        rc = pread(f->fd, f->data + off, f->st.st_size - off, off);
+
+        if (-1 == rc && EINTR == errno) {
+            rc = 0;
+            continue;
+        }
+
+        if (rc <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void free_file(struct FILECACHE *file)
+{
+    DO_LOCK(lock_filecache);
+    release(file);
+    DO_UNLOCK(lock_filecache);
+}
+
+/*
+ * Get an open regular file, NULL with errno set if there is none:
+ * EISDIR for directories, EACCES for anything else which isn't a
+ * regular file.  Release it with free_file().
+ */
+struct FILECACHE *get_file(char *filename)
+{
+    struct FILECACHE *f, *old;
+    struct stat st, lst;
+    struct tm tm;
+    char *mime;
+    unsigned int hash = hash_path(filename);
+    unsigned long gen;
+    size_t size;
+    int fd, len, keep, watched;
+
+    DO_LOCK(lock_filecache);
+
+    if (NULL != (f = lookup(filename, hash))) {
+        f->refcount++;
+
+        if (f->checked == now || f->watched) {
+            hits++;
+            lru_unlink(f);
+            lru_push(f);
+            DO_UNLOCK(lock_filecache);
+            return f;
+        }
+
+        /* revalidate without blocking the other workers */
+        DO_UNLOCK(lock_filecache);
+
+        if (0 == stat(filename, &st) && same_file(&st, &f->st)) {
+            keep = sidecars(filename, &st);
+            DO_LOCK(lock_filecache);
+            hits++;
+            f->checked  = now;
+            f->variants = keep;
+
+            if (f == lookup(filename, hash)) {
+                lru_unlink(f);
+                lru_push(f);
+            }
+
+            DO_UNLOCK(lock_filecache);
+            return f;
+        }
+
+        DO_LOCK(lock_filecache);
+        stale++;
+
+        if (f == lookup(filename, hash)) {
+            drop(f);
+        }
+
+        release(f);
+    }
+
+    misses++;
+    DO_UNLOCK(lock_filecache);
+
+    /* watch before opening, so no change after it goes unnoticed */
+    gen     = watch_generation();
+    watched = 0 == watch_parent(filename);
+
+    /* open outside the lock, another worker may race us to it */
+    if (-1 == (fd = open(filename, O_RDONLY | O_CLOEXEC))) {
+        return NULL;
+    }
+
+    fstat(fd, &st);
+
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+        return NULL;
+    }
+
+    /* changes through another hard link or a symlink's target happen
+     * outside the watched directory */
+    if (watched && (st.st_nlink != 1 ||
+                    0 != lstat(filename, &lst) || S_ISLNK(lst.st_mode))) {
+        watched = 0;
+    }
+
+    /* path, header template and (small) contents live in the same
+     * allocation */
+    mime = get_mime(filename);
+    len  = strlen(filename);
+    keep = st.st_size > 0 && st.st_size <= max_memfile && st.st_size <= max_memcache;
+    size = sizeof(*f) + len + 1 + MAX_TEMPLATE + (mime ? strlen(mime) : 32) +
+           (keep ? st.st_size : 0);
+
+    if (NULL == (f = malloc(size))) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    f->fd   = fd;
+    f->st   = st;
+    f->path = (char *)(f + 1);
+    memcpy(f->path, filename, len + 1);
+    f->tmpl = f->path + len + 1;
+    strftime(f->mtime, sizeof(f->mtime), RFC1123, gmtime_r(&st.st_mtime, &tm));
+    mketag(f->etag, &st);
+    f->ltmpl = mktemplate(f->tmpl, mime, st.st_size, f->mtime, f->etag);
+    f->data = keep ? f->tmpl + f->ltmpl : NULL;
+
+    if (keep && 0 != load(f)) {
+        /* changed under our feet, send it from the fd */
+        f->data = NULL;
+    }
+
+    f->hash     = hash;
+    f->gz       = NULL;
+    f->gzlength = 0;
+    f->variants = sidecars(filename, &st);
+    f->mime     = mime;
+    f->policy   = get_policy(filename + strlen(doc_root), mime);
+    f->checked  = now;
+    f->refcount = 2;                /* caller + cache */
+
+    DO_LOCK(lock_filecache);
+
+    if (NULL != (old = lookup(filename, hash))) {
+        if (same_file(&old->st, &f->st)) {
+            /* lost the race, use the winner */
+            old->refcount++;
+            DO_UNLOCK(lock_filecache);
+            close(f->fd);
+            free(f);
+            return old;
+        }
+
+        drop(old);
+    }
+
+    /* trust it only if nothing changed while we were reading */
+    f->watched = watched && gen == watch_generation();
+    f->hnext   = files[hash & (FC_BUCKETS - 1)];
+    files[hash & (FC_BUCKETS - 1)] = f;
+    lru_push(f);
+    nfiles++;
+
+    while (nfiles > max_filecache && lru_tail != f) {
+        drop(lru_tail);
+    }
+
+    if (f->data) {
+        trim_mem(f, f->st.st_size);
+        nmem++;
+        membytes += f->st.st_size;
+    }
+
+    DO_UNLOCK(lock_filecache);
+    return f;
+}
+
+/*
+ * stat() a file which isn't cached, so a revalidation can be answered
+ * without opening it.  Returns 0 and fills in st and the fresh sidecars
+ * for a regular file, -1 if it is cached already or anything else.
+ */
+int probe_file(char *filename, struct stat *st, int *variants)
+{
+    struct FILECACHE *f;
+
+    DO_LOCK(lock_filecache);
+    f = lookup(filename, hash_path(filename));
+    DO_UNLOCK(lock_filecache);
+
+    if (NULL != f || 0 != stat(filename, st) || !S_ISREG(st->st_mode)) {
+        return -1;
+    }
+
+    *variants = sidecars(filename, st);
+    return 0;
+}
+
+/* gzip'ed data of an in-memory file, compressed on first use */
+char *get_file_gz(struct FILECACHE *file, int *length)
+{
+    char *gz;
+    int  len;
+
+    DO_LOCK(lock_filecache);
+    len = file->gzlength;
+    DO_UNLOCK(lock_filecache);
+
+    if (0 == len && NULL != file->data) {
+        /* compress without the lock, a racing worker may have been faster */
+        gz = gzip(file->data, file->st.st_size, &len);
+        DO_LOCK(lock_filecache);
+
+        if (0 == file->gzlength) {
+            file->gz       = gz;
+            file->gzlength = len;
+            gz = NULL;
+
+            if (len > 0 && file == lookup(file->path, file->hash)) {
+                membytes += len;
+                trim_mem(file, 0);
+            }
+        }
+
+        len = file->gzlength;
+        DO_UNLOCK(lock_filecache);
+        free(gz);
+    }
+
+    *length = len;
+    return len > 0 ? file->gz : NULL;
+}
+
+/* called by watch.c when file >path< changed */
+void file_changed(char *path)
+{
+    struct FILECACHE *f;
+
+    DO_LOCK(lock_filecache);
+
+    if (NULL != (f = lookup(path, hash_path(path)))) {
+        invalidated++;
+        drop(f);
+    }
+
+    DO_UNLOCK(lock_filecache);
+}
+
+void flush_files(void)
+{
+    DO_LOCK(lock_filecache);
+
+    while (NULL != lru_tail) {
+        invalidated++;
+        drop(lru_tail);
+    }
+
+    DO_UNLOCK(lock_filecache);
+}
+
+void file_stats(char *buf, int size)
+{
+    DO_LOCK(lock_filecache);
+    snprintf(buf, size, "%d files, %d in memory (%" PRId64 " bytes), "
+             "%lu hits, %lu misses, %lu stale, %lu invalidated",
+             nfiles, nmem, (int64_t) membytes, hits, misses, stale, invalidated);
+    DO_UNLOCK(lock_filecache);
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "httpd.h"
+
+/*
+ * On-the-fly gzip for directory listings and small text files.  The
+ * callers keep the result next to the plain bytes, so every piece of
+ * content is compressed once.  All workers share a cpu budget of
+ * gzip_budget milliseconds per second; once it is used up, gzip()
+ * declines and the content goes out uncompressed until the next second.
+ */
+
+static pthread_mutex_t lock_budget = PTHREAD_MUTEX_INITIALIZER;
+static time_t   budget_sec;
+static int64_t  budget_used;            /* usec spent in budget_sec */
+
+static int64_t thread_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int budget_left(void)
+{
+    int left;
+
+    DO_LOCK(lock_budget);
+
+    if (budget_sec != now) {
+        budget_sec  = now;
+        budget_used = 0;
+    }
+
+    left = budget_used < (int64_t) gzip_budget * 1000;
+    DO_UNLOCK(lock_budget);
+    return left;
+}
+
+static void budget_spend(int64_t usec)
+{
+    DO_LOCK(lock_budget);
+    budget_used += usec;
+    DO_UNLOCK(lock_budget);
+}
+
+/* worth compressing at all? */
+int gzip_type(char *mime)
+{
+    if (0 == gzip_level || NULL == mime) {
+        return 0;
+    }
+
+    return 0 == strncmp(mime, "text/", 5) ||
+           NULL != strstr(mime, "javascript") ||
+           NULL != strstr(mime, "json") ||
+           NULL != strstr(mime, "xml");
+}
+
+/*
+ * Compress >len< bytes into a malloced gzip stream.  Returns NULL and
+ * sets *olen to 0 if the cpu budget is exhausted (try again later) or to
+ * -1 if the data is too small or doesn't shrink (don't bother again).
+ */
+char *gzip(char *in, int len, int *olen)
+{
+    z_stream zs;
+    char     *out, *shrunk;
+    int64_t  start;
+    int      rc, size;
+
+    *olen = -1;
+
+    if (len < gzip_min) {
+        return NULL;
+    }
+
+    if (!budget_left()) {
+        *olen = 0;
+        return NULL;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+
+    /* 15 + 16: gzip header and trailer instead of zlib's */
+    if (Z_OK != deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+        return NULL;
+    }
+
+    start = thread_usec();
+    size  = deflateBound(&zs, len);
+
+    if (NULL == (out = malloc(size))) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in   = (unsigned char *) in;
+    zs.avail_in  = len;
+    zs.next_out  = (unsigned char *) out;
+    zs.avail_out = size;
+    rc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    budget_spend(thread_usec() - start);
+
+    if (Z_STREAM_END != rc || zs.total_out >= len) {
+        free(out);
+        return NULL;
+    }
+
+    *olen = zs.total_out;
+
+    /* give back what deflateBound() reserved on top */
+    if (NULL != (shrunk = realloc(out, zs.total_out))) {
+        out = shrunk;
+    }
+
+    return out;
+}
@@ -1,4 +1,6 @@
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
 #define STATE_READ_HEADER   1
@@ -11,123 +13,251 @@
 
 #define STATE_KEEPALIVE     8
 #define STATE_CLOSE         9
+#define STATE_WRITE_STREAM 10
 
 #define MAX_HEADER 4096
 #define MAX_PATH   2048
 #define MAX_HOST     64
 #define MAX_MISC     16
-#define BR_HEADER   512
+#define BR_HEADER   160              /* multipart subheader, without mime type */
+#define MAX_HEADERS  64              /* header lines indexed per request */
+#define MAX_TEMPLATE 192             /* file header template, without mime type */
+#define MAX_ETAG     72              /* quoted, with -ndjson-gz suffixes */
 
 #define S1(str) #str
 #define S(str)  S1(str)
 
+/* listing orders, ?sort= */
+#define SORT_NAME    0
+#define SORT_SIZE    1
+#define SORT_MTIME   2
+#define SORT_KEYS    3
+
+/* listing formats, ?format= or Accept: */
+#define LIST_HTML    0
+#define LIST_JSON    1
+#define LIST_NDJSON  2
+#define LIST_FORMATS 3
+
 #define RFC1123    "%a, %d %b %Y %H:%M:%S GMT"
 
 #define MAXINTERFACES   16
 
+/* content codings, Accept-Encoding and precompressed sidecars */
+#define ENC_GZIP    1               /* foo.gz */
+#define ENC_BR      2               /* foo.br */
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+struct TIMER {
+    struct TIMER *next, *prev;  /* slot list, NULL if not armed */
+    uint64_t     expires;       /* mono_msec() */
+    int          level, slot;
+    void         *data;
+};
+
+struct WHEEL {
+    uint64_t     now;           /* next tick to process */
+    uint64_t     mask[WHEEL_LEVELS];
+    struct TIMER slot[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
 struct DIRCACHE {
-    char   path[1024];
+    char   *path;
+    unsigned int hash;
+    struct stat st;                  /* of the directory */
     char   mtime[40];
+    char   etag[MAX_ETAG];           /* from the cache generation */
+    struct POLICY *policy;
     time_t add;
-    char   *html;
-    int    length;
-    int    refcount;
+    char   *body[LIST_FORMATS];      /* default view by LIST_*, see get_dir_body */
+    int    length[LIST_FORMATS];
+    struct myfile **files;           /* entries, sorted by name */
+    int    nfiles;
+    int    ndirs;                    /* directories come first */
+    struct myfile **order[SORT_KEYS]; /* by SORT_*, see get_order */
+    char   *gz[LIST_FORMATS];        /* gzip'ed bodies, see get_dir_gz */
+    int    gzlength[LIST_FORMATS];
+    int    refcount;                 /* requests, +1 while cached */
+    int    cached;
+    int    watched;                  /* fresh until watch.c says otherwise */
+    off_t  bytes;                    /* charged to the cache */
     int    reading;
 
-    pthread_mutex_t lock_refcount;
     pthread_mutex_t lock_reading;
     pthread_cond_t  wait_reading;
 
-    struct DIRCACHE *next;
+    struct DIRCACHE *hnext;          /* hash chain */
+    struct DIRCACHE *prev, *next;    /* lru list */
+};
+
+/* Cache-Control/Expires for a path prefix or mime type (policy.c) */
+struct POLICY {
+    char   *match;
+    int    len;
+    int    path;                    /* match is a path prefix */
+    int    prefix;                  /* ... or a "type/" prefix */
+    int    maxage;
+    char   *header;                 /* Cache-Control line */
+    int    lheader;
+};
+
+/* open regular file, shared by all workers (fcache.c) */
+struct FILECACHE {
+    char        *path;
+    unsigned int hash;
+    int         fd;
+    struct stat st;
+    char        mtime[40];           /* RFC 1123 */
+    char        etag[MAX_ETAG];      /* inode, size and mtime */
+    char        *mime;
+    struct POLICY *policy;           /* resolved for the original path */
+    char        *tmpl;               /* header lines, see mktemplate */
+    int         ltmpl;
+    char        *data;               /* contents of small files */
+    int         variants;            /* fresh sidecars, ENC_* */
+    char        *gz;                 /* gzip'ed data, see get_file_gz */
+    int         gzlength;
+    time_t      checked;             /* last revalidation */
+    int         watched;             /* no revalidation, see watch.c */
+    int         refcount;            /* requests, +1 while cached */
+
+    struct FILECACHE *hnext;         /* hash chain */
+    struct FILECACHE *prev, *next;   /* lru list */
+};
+
+/* a request header line, offsets into hreq */
+struct HEADER {
+    unsigned short name, lname;
+    unsigned short value, lvalue;
+};
+
+/* per-request buffers, borrowed from the worker's pool while a request
+ * is in flight and handed back when the connection goes idle */
+struct REQBUF {
+    struct REQBUF *next;             /* pool free list */
+    int         r_cap;               /* ranges r_* have room for */
+    int         r_hcap;              /* bytes r_head has room for */
+    off_t       *r_start;            /* range buffers, one allocation */
+    struct stat bst;
+    char        hostname[MAX_HOST+1];
+    char        auth[64];
+    char        mtime[40];
+    char        etag[MAX_ETAG];
+    char        hreq[MAX_HEADER+1];
+    struct HEADER hdr[MAX_HEADERS];  /* the first nhdr header lines */
+    char        path[MAX_PATH+1];
+    char        query[MAX_PATH+1];
+    char        hres[MAX_HEADER+1];
+    struct iovec  iov[2];            /* io_uring: header + body */
+    struct msghdr msg;
 };
 
 struct REQUEST {
     int    fd;             /* socket handle */
     int    state;                 /* what to to ??? */
-    time_t ping;                /* last read/write (for timeouts) */
+    struct TIMER timer;         /* timeout, re-armed on read/write */
     int    keep_alive;
-
-    struct sockaddr_storage peer;         /* client (log) */
-    char        peerhost[MAX_HOST+1];
-    char        peerserv[MAX_MISC+1];
+    int    events;              /* registered epoll interest */
+    int    inflight;            /* io_uring: direction of queued op */
+    int    op;                  /* io_uring: queued operation */
+    int    cancel;              /* io_uring: cancel requested */
 
     /* request */
-    char    hreq[MAX_HEADER+1];   /* request header */
     int     lreq;              /* request length */
     int         hdata;                /* data in hreq */
-    char        type[MAX_MISC+1];     /* req type */
-    char        hostname[MAX_HOST+1]; /* hostname */
-    char    uri[MAX_PATH+1];      /* req uri */
-    char    path[MAX_PATH+1];     /* file path */
-    char    query[MAX_PATH+1];    /* query string */
+    int         hscan;               /* hreq is scanned up to here */
+    int         hline;               /* start of the current line */
     int         major,minor;          /* http version */
-    char        auth[64];
-    struct strlist *header;
+    int         nhdr;                /* lines in buf->hdr */
     char        *if_modified;
     char        *if_unmodified;
     char        *if_range;
+    char        *if_none_match;
     char        *range_hdr;
     int         ranges;
-    off_t       *r_start;
-    off_t       *r_end;
-    char        *r_head;
-    int         *r_hlen;
+    int         accept_enc;          /* ENC_* the client takes */
+    int         list_view;           /* listing ?offset=&limit=&sort=&order= */
+    int         list_offset;
+    int         list_limit;          /* rows per page, 0 for all */
+    int         list_sort;           /* SORT_* */
+    int         list_desc;
+    int         list_format;         /* LIST_*, ?format= or Accept: */
 
     /* response */
     int         status;              /* status code (log) */
     int         bc;                  /* byte counter (log) */
-    char    hres[MAX_HEADER+1];  /* response header */
     int            lres;             /* header length */
     char        *mime;               /* mime type */
+    char        *encoding;           /* Content-Encoding or NULL */
+    int         vary;                /* send Vary: Accept-Encoding */
+    struct POLICY *policy;           /* Cache-Control/Expires, or NULL */
     char    *body;
     off_t       lbody;
     int         bfd;                 /* file descriptor */
-    struct stat bst;                 /* file info */
-    char        mtime[40];           /* RFC 1123 */
+    struct FILECACHE *file;          /* bfd belongs to this */
     off_t       written;
     int         head_only;
     int         rh,rb;
     struct DIRCACHE *dir;
+    struct LSSTREAM *stream;         /* listing rendered while sent */
+    int         chunked;             /* Transfer-Encoding: chunked */
+    int         pipefd[2];           /* io_uring splice pipe */
+    int         piped;               /* bytes sitting in the pipe */
 
     /* linked list */
+    struct REQUEST *prev;
     struct REQUEST *next;
-};
-
 
-struct strlist {
-    struct strlist *next;
-    char *line;
-    int free_the_mallocs;
+    /* borrowed buffers, everything below points into buf and is
+     * NULL while the connection is idle (pool_attach/pool_detach) */
+    struct REQBUF *buf;
+    char        *hreq;               /* request header */
+    char        *type;               /* req type, in hreq */
+    char        *hostname;           /* hostname */
+    char        *auth;
+    char        *uri;                /* req uri, in hreq */
+    char        *path;               /* file path */
+    char        *query;              /* query string */
+    char        *hres;               /* response header */
+    char        *mtime;              /* RFC 1123 */
+    char        *etag;               /* quoted, empty if none */
+    struct stat *bst;                /* file info */
+    off_t       *r_start;
+    off_t       *r_end;
+    int         *r_hoff;             /* subheader i is r_head[r_hoff[i]..r_hoff[i+1]] */
+    char        *r_head;
 };
 
-/* add element (list head) */
-static void inline list_add(struct strlist **list, char *line, int free_the_mallocs)
-{
-    struct strlist *elem = malloc(sizeof(struct strlist));
-    memset(elem,0,sizeof(struct strlist));
-    elem->next = *list;
-    elem->line = line;
-    elem->free_the_mallocs = free_the_mallocs;
-    *list = elem;
-}
+/* per-thread free lists of REQUEST objects, carved from slabs, and of
+ * the request buffers */
+struct POOL {
+    struct REQUEST *free;
+    unsigned long  slabs;            /* slabs allocated */
+    unsigned long  objects;          /* REQUESTs in all slabs */
+    unsigned long  used;             /* handed out right now */
+    unsigned long  peak;
+    unsigned long  gets;
 
-/* free whole list */
-static void inline list_free(struct strlist **list)
-{
-    struct strlist *elem,*next;
-
-    for (elem = *list; NULL != elem; elem = next) {
-    next = elem->next;
-    if (elem->free_the_mallocs)
-        free(elem->line);
-    free(elem);
-    }
-    *list = NULL;
-}
+    struct REQBUF  *bufs;
+    unsigned long  nbufs;            /* REQBUFs allocated */
+    unsigned long  bufs_used;        /* attached right now */
+    unsigned long  bufs_peak;
+};
 
 /* --- main.c --------------------------------------------------- */
 extern int    tcp_port;
-extern int    max_dircache;
+extern off_t  max_dircache;
+extern int    max_ranges;
+extern int    max_filecache;
+extern int    gzip_level;
+extern int    gzip_min;
+extern int    gzip_budget;
+extern off_t  max_memfile;
+extern off_t  max_memcache;
 extern int    canonicalhost;
 extern int    do_chroot;
 extern char   *server_name;
@@ -146,25 +276,119 @@ static void inline close_on_exec(int fd)
 
 /* --- request.c ------------------------------------------------ */
 void read_request(struct REQUEST *req, int pipelined);
+void scan_request(struct REQUEST *req);
 void parse_request(struct REQUEST *req);
 
 /* --- response.c ----------------------------------------------- */
 void mkerror(struct REQUEST *req, int status, int ka);
 void mkredirect(struct REQUEST *req);
 void mkheader(struct REQUEST *req, int status);
+int mktemplate(char *buf, char *mime, off_t size, char *mtime, char *etag);
+int mketag(char *buf, struct stat *st);
+off_t next_chunk(struct REQUEST *req, char **buf, off_t *off);
+void chunk_written(struct REQUEST *req, off_t bytes);
+int header_body(struct REQUEST *req, struct iovec *iov);
+int chunk_more(struct REQUEST *req);
 void write_request(struct REQUEST *req);
 
 /* --- ls.c ----------------------------------------------------- */
 void init_quote(void);
 char *quote(unsigned char *path, int maxlength);
 struct DIRCACHE *get_dir(struct REQUEST *req, char *filename);
+char *get_dir_body(struct REQUEST *req, int *length);
+char *get_dir_gz(struct DIRCACHE *dir, int format, int *length);
 void free_dir(struct DIRCACHE *dir);
+int open_stream(struct REQUEST *req);
+void close_stream(struct REQUEST *req);
+off_t next_stream(struct REQUEST *req, char **buf);
+int stream_more(struct REQUEST *req);
+int stream_done(struct REQUEST *req);
+void dir_changed(char *path);
+void flush_dirs(void);
+void dir_stats(char *buf, int size);
+void init_dircache(void);
+
+/* --- fcache.c ------------------------------------------------ */
+
+unsigned int hash_path(char *path);
+struct FILECACHE *get_file(char *filename);
+int probe_file(char *filename, struct stat *st, int *variants);
+void free_file(struct FILECACHE *file);
+char *get_file_gz(struct FILECACHE *file, int *length);
+void file_changed(char *path);
+void flush_files(void);
+void file_stats(char *buf, int size);
+
+/* --- watch.c -------------------------------------------------- */
+
+unsigned long watch_generation(void);
+int watch_dir(char *dir);
+void init_watch(void);
+void watch_stats(char *buf, int size);
+
+/* --- gzip.c --------------------------------------------------- */
+
+int gzip_type(char *mime);
+char *gzip(char *in, int len, int *olen);
+
+/* --- policy.c ------------------------------------------------- */
+
+struct POLICY *get_policy(char *path, char *mime);
+void init_policy(char *file);
 
 /* --- mime.c --------------------------------------------------- */
 
 char *get_mime(char *file);
 void init_mime(char *file, char *def);
 
+/* --- uring.c -------------------------------------------------- */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct URING {
+    int         fd;
+    unsigned    entries;
+    unsigned    queued;         /* sqes not submitted yet */
+    unsigned    *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned    *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void        *ring;
+    size_t      ring_size, sqes_size;
+};
+
+int uring_init(struct URING *ring, unsigned entries);
+void uring_exit(struct URING *ring);
+int uring_submit(struct URING *ring, unsigned wait, int64_t msec);
+struct io_uring_sqe *uring_get_sqe(struct URING *ring);
+struct io_uring_cqe *uring_peek_cqe(struct URING *ring);
+void uring_cqe_seen(struct URING *ring);
+
+/* --- clock.c -------------------------------------------------- */
+
+int date_header(char *buf);
+int expires_header(char *buf, int maxage);
+char *get_time(void);
+
+/* --- timer.c -------------------------------------------------- */
+
+uint64_t mono_msec(void);
+void wheel_init(struct WHEEL *wh, uint64_t now);
+void timer_set(struct WHEEL *wh, struct TIMER *t, uint64_t expires);
+void timer_del(struct WHEEL *wh, struct TIMER *t);
+void wheel_run(struct WHEEL *wh, uint64_t now, void (*expire)(void *data, void *arg), void *arg);
+int64_t wheel_next(struct WHEEL *wh, uint64_t now);
+
+/* --- pool.c --------------------------------------------------- */
+
+struct REQUEST *pool_get(struct POOL *pool);
+void pool_put(struct POOL *pool, struct REQUEST *req);
+int pool_attach(struct POOL *pool, struct REQUEST *req);
+void pool_detach(struct POOL *pool, struct REQUEST *req);
+int pool_ranges(struct REQUEST *req, int ranges, int hsize);
+void pool_stats(struct POOL *pool, char *buf, int size);
+
 /* -------------------------------------------------------------- */
 
 # define INIT_LOCK(mutex)      pthread_mutex_init(&mutex,NULL)
@@ -1,13 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
 #include <ctype.h>
 #include <pwd.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 
 #include "httpd.h"
 
@@ -15,16 +19,43 @@
 #define MAX_CACHE_AGE   3600   /* seconds */
 #define HOMEPAGE "https://code.google.com/p/gx-gongxiang/"
 #define CACHE_SIZE 32
-
-static pthread_mutex_t lock_dircache = PTHREAD_MUTEX_INITIALIZER;
-
+#define NSS_BUF_SIZE    16384           /* getpwuid_r/getgrgid_r, big groups */
+
+#define LS_DENTS_SIZE   (64 * 1024)     /* getdents64 buffer */
+#define LS_PARALLEL     4096            /* entries before stats are shared */
+#define LS_BATCH        256             /* entries a stat helper takes */
+#define LS_HELPERS      4               /* at most, one less than cpus */
+#define LS_STREAM       4096            /* entries before listings stream */
+#define LS_STREAM_BUF   (32 * 1024)     /* per streaming request */
+#define LS_MAX_ROW      4096            /* longest piece of a listing */
+
+/* pieces of a listing, in order */
+#define PART_TITLE      0
+#define PART_CRUMBS     1
+#define PART_TABLE      2
+#define PART_ROWS       3
+#define PART_PAGES      4
+#define PART_FOOT       5
+#define PART_DONE       6
+
+/* every listing built gets the next generation for its ETag, the epoch
+ * keeps tags handed out by an earlier run from matching */
+static time_t        dir_epoch;
+static unsigned long dir_generation;
+
+/*
+ * uid/gid -> name, remembering the last CACHE_SIZE of each.  Workers
+ * render listings concurrently, so each thread has its own caches, and
+ * the lookups use the reentrant calls.
+ */
 static char *xgetpwuid(uid_t uid)
 {
-    static char           *cache[CACHE_SIZE];
-    static uid_t          uids[CACHE_SIZE];
-    static unsigned int   used, next;
-    struct passwd *pw;
-    int i;
+    static __thread char         *cache[CACHE_SIZE];
+    static __thread uid_t        uids[CACHE_SIZE];
+    static __thread unsigned int used, next;
+    struct passwd pwbuf, *pw;
+    char buf[NSS_BUF_SIZE];
+    int  i;
 
     for (i = 0; i < used; i++) {
         if (uids[i] == uid) {
@@ -33,19 +64,14 @@ static char *xgetpwuid(uid_t uid)
     }
 
     /* 404 */
-    pw = getpwuid(uid);
-
-    if (NULL != cache[next]) {
-        free(cache[next]);
-        cache[next] = NULL;
-    }
-
-    if (NULL != pw) {
-        cache[next] = strdup(pw->pw_name);
+    if (0 != getpwuid_r(uid, &pwbuf, buf, sizeof(buf), &pw)) {
+        pw = NULL;
     }
 
-    uids[next] = uid;
-    next++;
+    free(cache[next]);
+    cache[next] = pw ? strdup(pw->pw_name) : NULL;
+    uids[next]  = uid;
+    i = next++;
 
     if (CACHE_SIZE == next) {
         next = 0;
@@ -55,16 +81,17 @@ static char *xgetpwuid(uid_t uid)
         used++;
     }
 
-    return pw ? pw->pw_name : NULL;
+    return cache[i];
 }
 
 static char *xgetgrgid(gid_t gid)
 {
-    static char           *cache[CACHE_SIZE];
-    static gid_t          gids[CACHE_SIZE];
-    static unsigned int   used, next;
-    struct group *gr;
-    int i;
+    static __thread char         *cache[CACHE_SIZE];
+    static __thread gid_t        gids[CACHE_SIZE];
+    static __thread unsigned int used, next;
+    struct group grbuf, *gr;
+    char buf[NSS_BUF_SIZE];
+    int  i;
 
     for (i = 0; i < used; i++) {
         if (gids[i] == gid) {
@@ -73,19 +100,14 @@ static char *xgetgrgid(gid_t gid)
     }
 
     /* 404 */
-    gr = getgrgid(gid);
-
-    if (NULL != cache[next]) {
-        free(cache[next]);
-        cache[next] = NULL;
-    }
-
-    if (NULL != gr) {
-        cache[next] = strdup(gr->gr_name);
+    if (0 != getgrgid_r(gid, &grbuf, buf, sizeof(buf), &gr)) {
+        gr = NULL;
     }
 
-    gids[next] = gid;
-    next++;
+    free(cache[next]);
+    cache[next] = gr ? strdup(gr->gr_name) : NULL;
+    gids[next]  = gid;
+    i = next++;
 
     if (CACHE_SIZE == next) {
         next = 0;
@@ -95,27 +117,249 @@ static char *xgetgrgid(gid_t gid)
         used++;
     }
 
-    return gr ? gr->gr_name : NULL;
+    return cache[i];
 }
 
 struct myfile {
-    int           r;
-    struct stat   s;
+    int           r;                /* readable, -1 if stat failed */
+    mode_t        mode;
+    uid_t         uid;
+    gid_t         gid;
+    off_t         size;
+    time_t        mtime;
     char          n[1];
 };
 
+/* the rows a listing shows */
+struct LSVIEW {
+    struct myfile **files;          /* in the order asked for */
+    int           count, ndirs;
+    int           first, end;       /* rows [first, end) */
+    int           desc;             /* backwards, directories still first */
+    int           sort, limit;      /* for the page links */
+    int           format;           /* LIST_* */
+};
+
+/* where rendering a listing left off */
+struct LSPOS {
+    int           part;
+    char          *h1, *h2;         /* PART_CRUMBS: the next link */
+    int           i;                /* PART_ROWS: the next row */
+    int           rows;             /* rows written, for json's commas */
+};
+
 static int compare_files(const void *a, const void *b)
 {
     const struct myfile *aa = *(struct myfile **)a;
     const struct myfile *bb = *(struct myfile **)b;
 
-    if (S_ISDIR(aa->s.st_mode) !=  S_ISDIR(bb->s.st_mode)) {
-        return S_ISDIR(aa->s.st_mode) ? -1 : 1;
+    if (S_ISDIR(aa->mode) !=  S_ISDIR(bb->mode)) {
+        return S_ISDIR(aa->mode) ? -1 : 1;
     }
 
     return strcmp(aa->n, bb->n);
 }
 
+static int compare_size(const void *a, const void *b)
+{
+    const struct myfile *aa = *(struct myfile **)a;
+    const struct myfile *bb = *(struct myfile **)b;
+
+    if (S_ISDIR(aa->mode) != S_ISDIR(bb->mode) || aa->size == bb->size) {
+        return compare_files(a, b);
+    }
+
+    return aa->size < bb->size ? -1 : 1;
+}
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const struct myfile *aa = *(struct myfile **)a;
+    const struct myfile *bb = *(struct myfile **)b;
+
+    if (S_ISDIR(aa->mode) != S_ISDIR(bb->mode) || aa->mtime == bb->mtime) {
+        return compare_files(a, b);
+    }
+
+    return aa->mtime < bb->mtime ? -1 : 1;
+}
+
+/*
+ * Stat the entries of a directory relative to its fd, asking statx()
+ * only for the fields a listing shows.  Listings of more than
+ * LS_PARALLEL entries are shared with a few helper threads: the entries
+ * are handed out LS_BATCH at a time to whoever asks, the request
+ * building the listing included, so it never waits for an idle helper.
+ */
+
+struct STATJOB {
+    int            dfd;
+    uid_t          uid;
+    gid_t          gid;
+    struct myfile  **files;
+    int            count;
+    int            next;            /* first entry not handed out */
+    int            busy;            /* helpers working on it */
+    int            queued;
+    struct STATJOB *qnext;
+};
+
+static pthread_mutex_t lock_stat = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wait_job  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  wait_done = PTHREAD_COND_INITIALIZER;
+static struct STATJOB  *jobs;
+static int             nhelpers, no_statx;
+
+static void stat_file(struct STATJOB *job, struct myfile *f)
+{
+    struct statx stx;
+    struct stat  st;
+
+    if (!no_statx) {
+        if (0 == statx(job->dfd, f->n, AT_NO_AUTOMOUNT,
+                       STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+                       STATX_SIZE | STATX_MTIME, &stx)) {
+            f->mode  = stx.stx_mode;
+            f->uid   = stx.stx_uid;
+            f->gid   = stx.stx_gid;
+            f->size  = stx.stx_size;
+            f->mtime = stx.stx_mtime.tv_sec;
+            goto got;
+        }
+
+        if (ENOSYS != errno) {
+            f->r = -1;
+            return;
+        }
+
+        /* old kernel */
+        no_statx = 1;
+    }
+
+    if (-1 == fstatat(job->dfd, f->n, &st, AT_NO_AUTOMOUNT)) {
+        f->r = -1;
+        return;
+    }
+
+    f->mode  = st.st_mode;
+    f->uid   = st.st_uid;
+    f->gid   = st.st_gid;
+    f->size  = st.st_size;
+    f->mtime = st.st_mtime;
+got:
+    f->r = 0;
+
+    if (S_ISDIR(f->mode) || S_ISREG(f->mode)) {
+        if (f->uid == job->uid && f->mode & 0400) {
+            f->r = 1;
+        } else if (f->gid == job->gid && f->mode & 0040) {
+            f->r = 1;
+        } else if (f->mode & 0004) {
+            f->r = 1;
+        }
+    }
+}
+
+/* --- with lock_stat held ---------------------------------------------- */
+
+/* stat the next batch of job's entries, 0 if there was none left */
+static int stat_batch(struct STATJOB *job)
+{
+    int i, start = job->next, end = start + LS_BATCH;
+
+    if (start >= job->count) {
+        return 0;
+    }
+
+    if (end > job->count) {
+        end = job->count;
+    }
+
+    job->next = end;
+    DO_UNLOCK(lock_stat);
+
+    for (i = start; i < end; i++) {
+        stat_file(job, job->files[i]);
+    }
+
+    DO_LOCK(lock_stat);
+    return 1;
+}
+
+static void dequeue(struct STATJOB *job)
+{
+    struct STATJOB **p;
+
+    if (!job->queued) {
+        return;
+    }
+
+    for (p = &jobs; *p != job; p = &(*p)->qnext)
+        ;
+
+    *p = job->qnext;
+    job->queued = 0;
+}
+
+/* --------------------------------------------------------------------- */
+
+static void *stat_helper(void *arg)
+{
+    struct STATJOB *job;
+
+    DO_LOCK(lock_stat);
+
+    for (;;) {
+        while (NULL == (job = jobs)) {
+            WAIT_COND(wait_job, lock_stat);
+        }
+
+        job->busy++;
+
+        while (stat_batch(job))
+            ;
+
+        dequeue(job);
+        job->busy--;
+        BCAST_COND(wait_done);
+    }
+
+    return NULL;
+}
+
+static void stat_files(struct STATJOB *job)
+{
+    int i;
+
+    if (job->count < LS_PARALLEL || 0 == nhelpers) {
+        for (i = 0; i < job->count; i++) {
+            stat_file(job, job->files[i]);
+        }
+
+        return;
+    }
+
+    DO_LOCK(lock_stat);
+    job->next   = 0;
+    job->busy   = 0;
+    job->queued = 1;
+    job->qnext  = jobs;
+    jobs = job;
+    BCAST_COND(wait_job);
+
+    while (stat_batch(job))
+        ;
+
+    /* done once no helper is still busy with a batch */
+    dequeue(job);
+
+    while (job->busy > 0) {
+        WAIT_COND(wait_done, lock_stat);
+    }
+
+    DO_UNLOCK(lock_stat);
+}
+
 static char do_quote[256];
 
 void init_quote(void)
@@ -135,7 +379,7 @@ void init_quote(void)
 
 char *quote(unsigned char *path, int maxlength)
 {
-    static char buf[2048];
+    static __thread char buf[2048];
     int i, j, n = strlen((char *)path);
 
     if (n > maxlength) {
@@ -197,352 +441,1002 @@ static void strmode(mode_t mode, char *dest)
             rwx[mode        & 0x7]);
 }
 
-static char *ls(time_t now, char *hostname, char *filename, char *path, int *length)
+static void free_files(struct myfile **files, int count)
 {
-    DIR            *dir;
-    struct dirent  *file;
-    struct myfile  **files = NULL;
-    struct myfile  **re1;
-    char           *h1, *h2, *re2, *buf = NULL;
-    int            count, len, size, i;
-    uid_t          uid;
-    gid_t          gid;
-    char           line[1024];
-    char           *pw = NULL, *gr = NULL;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(files[i]);
+    }
 
-    if (NULL == (dir = opendir(filename))) {
+    free(files);
+}
+
+/*
+ * The entries of directory >filename<, sorted, NULL if it can't be read.
+ * *bytes gets what they take up in memory.
+ */
+static struct myfile **scan_dir(char *filename, char *path, int *nfiles, off_t *bytes)
+{
+    struct STATJOB job;
+    struct dirent64 *file;
+    struct myfile  **files, **re1;
+    char           *dents;
+    int            count = 0, i;
+    long           n, off;
+
+    if (-1 == (job.dfd = open(filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
         return NULL;
     }
 
-    /* read dir */
-    uid = getuid();
-    gid = getgid();
+    dents = malloc(LS_DENTS_SIZE);
+    files = malloc(64 * sizeof(struct myfile *));
 
-    for (count = 0;; count++) {
-        if (NULL == (file = readdir(dir))) {
-            break;
-        }
+    if (NULL == dents || NULL == files) {
+        goto oom;
+    }
 
-        if (0 == strcmp(file->d_name, ".")) {
-            /* skip the the "." directory */
-            count--;
-            continue;
-        }
+    /* read dir */
+    *bytes = 0;
 
-        if (0 == strcmp(path, "/") && 0 == strcmp(file->d_name, "..")) {
-            /* skip the ".." directory in root dir */
-            count--;
-            continue;
-        }
+    while ((n = syscall(SYS_getdents64, job.dfd, dents, LS_DENTS_SIZE)) > 0) {
+        for (off = 0; off < n; off += file->d_reclen) {
+            file = (struct dirent64 *)(dents + off);
 
-        if (0 == (count % 64)) {
-            re1 = realloc(files, (count + 64) * sizeof(struct myfile *));
+            if (0 == strcmp(file->d_name, ".")) {
+                /* skip the the "." directory */
+                continue;
+            }
 
-            if (NULL == re1) {
-                goto oom;
+            if (0 == strcmp(path, "/") && 0 == strcmp(file->d_name, "..")) {
+                /* skip the ".." directory in root dir */
+                continue;
             }
 
-            files = re1;
-        }
+            if (count > 0 && 0 == (count % 64)) {
+                re1 = realloc(files, (count + 64) * sizeof(struct myfile *));
 
-        files[count] = malloc(strlen(file->d_name) + sizeof(struct myfile));
+                if (NULL == re1) {
+                    goto oom;
+                }
 
-        if (NULL == files[count]) {
-            goto oom;
-        }
+                files = re1;
+            }
 
-        strcpy(files[count]->n, file->d_name);
-        sprintf(line, "%s/%s", filename, file->d_name);
+            i = strlen(file->d_name);
 
-        if (-1 == stat(line, &files[count]->s)) {
-            free(files[count]);
-            count--;
-            continue;
+            if (NULL == (files[count] = malloc(sizeof(struct myfile) + i))) {
+                goto oom;
+            }
+
+            memcpy(files[count]->n, file->d_name, i + 1);
+            *bytes += sizeof(struct myfile *) + sizeof(struct myfile) + i;
+            count++;
         }
+    }
 
-        files[count]->r = 0;
+    free(dents);
 
-        if (S_ISDIR(files[count]->s.st_mode) || S_ISREG(files[count]->s.st_mode)) {
-            if (files[count]->s.st_uid == uid && files[count]->s.st_mode & 0400) {
-                files[count]->r = 1;
-            } else if (files[count]->s.st_gid == gid && files[count]->s.st_mode & 0040) {
-                files[count]->r = 1;
-            } else if (files[count]->s.st_mode & 0004) {
-                files[count]->r = 1;
-            }
+    /* stat them all, forget the ones which vanished meanwhile */
+    job.uid   = getuid();
+    job.gid   = getgid();
+    job.files = files;
+    job.count = count;
+    stat_files(&job);
+    close(job.dfd);
+
+    for (i = 0, n = 0; i < count; i++) {
+        if (files[i]->r < 0) {
+            free(files[i]);
+        } else {
+            files[n++] = files[i];
         }
     }
 
-    closedir(dir);
+    count = n;
 
     /* sort */
     if (count) {
         qsort(files, count, sizeof(struct myfile *), compare_files);
     }
 
-    /* output */
-    size = LS_ALLOC_SIZE;
-    buf  = malloc(size);
+    *nfiles = count;
+    return files;
+oom:
+    fprintf(stderr, "oom\n");
+    close(job.dfd);
+    free(dents);
+
+    if (files) {
+        free_files(files, count);
+    }
+
+    return NULL;
+}
+
+/* one line of the listing, at most LS_MAX_ROW bytes */
+static int ls_row(char *buf, struct myfile *f)
+{
+    struct tm tm;
+    char      *pw, *gr;
+    int       len = 0;
+
+    /* mode */
+    strmode(f->mode, buf + len);
+    len += 10;
+    buf[len++] = ' ';
+    buf[len++] = ' ';
+    /* user */
+    pw = xgetpwuid(f->uid);
 
-    if (NULL == buf) {
-        goto oom;
+    if (NULL != pw) {
+        len += sprintf(buf + len, "%-8.8s  ", pw);
+    } else {
+        len += sprintf(buf + len, "%8d  ", (int)f->uid);
     }
 
-    len  = 0;
-    len += sprintf(buf + len,
-                   "<head><meta content=\"text/html; charset=UTF-8\" http-equiv=\"Content-Type\"><title>%s:%d%s</title></head>\n"
-                   "<body bgcolor=white text=black link=darkblue vlink=firebrick>\n"
-                   "<h1>listing: \n",
-                   hostname, tcp_port, path);
-    h1 = path, h2 = path + 1;
+    /* group */
+    gr = xgetgrgid(f->gid);
 
-    for (;;) {
-        if (len > size) {
-            abort();
-        }
+    if (NULL != gr) {
+        len += sprintf(buf + len, "%-8.8s  ", gr);
+    } else {
+        len += sprintf(buf + len, "%8d  ", (int)f->gid);
+    }
 
-        if (len + (LS_ALLOC_SIZE >> 2) > size) {
-            size += LS_ALLOC_SIZE;
-            re2 = realloc(buf, size);
+    /* mtime */
+    if (now - f->mtime > 60 * 60 * 24 * 30 * 6)
+        len += strftime(buf + len, 255, "%b %d  %Y  ",
+                        gmtime_r(&f->mtime, &tm));
+    else
+        len += strftime(buf + len, 255, "%b %d %H:%M  ",
+                        gmtime_r(&f->mtime, &tm));
+
+    /* size */
+    if (S_ISDIR(f->mode)) {
+        len += sprintf(buf + len, "  &lt;DIR&gt;  ");
+    } else if (!S_ISREG(f->mode)) {
+        len += sprintf(buf + len, "     --  ");
+    } else if (f->size < 1024 * 9) {
+        len += sprintf(buf + len, "%4d  B  ",
+                       (int)f->size);
+    } else if (f->size < 1024 * 1024 * 9) {
+        len += sprintf(buf + len, "%4d kB  ",
+                       (int)(f->size >> 10));
+    } else if ((int64_t)(f->size) < (int64_t)1024 * 1024 * 1024 * 9) {
+        len += sprintf(buf + len, "%4d MB  ",
+                       (int)(f->size >> 20));
+    } else if ((int64_t)(f->size) < (int64_t)1024 * 1024 * 1024 * 1024 * 9) {
+        len += sprintf(buf + len, "%4d GB  ",
+                       (int)(f->size >> 30));
+    } else {
+        len += sprintf(buf + len, "%4d TB  ",
+                       (int)(f->size >> 40));
+    }
 
-            if (NULL == re2) {
-                goto oom;
-            }
+    /* filename */
+    if (f->r) {
+        len += sprintf(buf + len, "<a href=\"%s%s\">%s</a>\n",
+                       quote((unsigned char *) f->n, 9999),
+                       S_ISDIR(f->mode) ? "/" : "",
+                       f->n);
+    } else {
+        len += sprintf(buf + len, "%s\n", f->n);
+    }
 
-            buf = re2;
-        }
+    return len;
+}
+
+/* >s< as a json string, cut short instead of taking more than max bytes */
+static int json_str(char *buf, char *s, int max)
+{
+    unsigned char c;
+    int len = 0;
 
-        len += sprintf(buf + len, "<a href=\"%s\">%*.*s</a>",
-                       quote((unsigned char *) path, h2 - path),
-                       (int)(h2 - h1),
-                       (int)(h2 - h1),
-                       h1);
-        h1 = h2;
-        h2 = strchr(h2, '/');
+    buf[len++] = '"';
 
-        if (NULL == h2) {
-            break;
+    for (; 0 != (c = *s) && len < max - 8; s++) {
+        if (c == '"' || c == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            len += sprintf(buf + len, "\\u%04x", c);
+        } else {
+            buf[len++] = c;
         }
+    }
+
+    buf[len++] = '"';
+    return len;
+}
+
+/* one entry as a json object, at most LS_MAX_ROW bytes */
+static int json_row(char *buf, struct myfile *f)
+{
+    int len;
+
+    len  = sprintf(buf, "{\"name\":");
+    len += json_str(buf + len, f->n, LS_MAX_ROW - 128);
+    len += sprintf(buf + len, ",\"type\":\"%s\",\"size\":%" PRId64 ",\"mtime\":%" PRId64
+                   ",\"mode\":\"%04o\"}",
+                   S_ISDIR(f->mode) ? "dir" : S_ISREG(f->mode) ? "file" : "other",
+                   (int64_t) f->size, (int64_t) f->mtime, (unsigned int)(f->mode & 07777));
+    return len;
+}
 
-        h2++;
+/* the entry shown in row i */
+static struct myfile *view_row(struct LSVIEW *view, int i)
+{
+    if (view->desc) {
+        i = i < view->ndirs ? view->ndirs - 1 - i
+            : view->count - 1 - (i - view->ndirs);
     }
 
-    len += sprintf(buf + len,
-                   "</h1><hr noshade size=1><pre>\n"
-                   "<b>access      user      group     date             "
-                   "size  name</b>\n\n");
+    return view->files[i];
+}
 
-    for (i = 0; i < count; i++) {
-        if (len > size) {
-            abort();
+static int render_html(struct REQUEST *req, struct LSVIEW *view,
+                       struct LSPOS *pos, char *buf, int size)
+{
+    static const char *sorts[SORT_KEYS] = { "name", "size", "mtime" };
+    struct tm tm;
+    char      date[32];
+    int       len = 0;
+
+    while (pos->part != PART_DONE && size - len >= LS_MAX_ROW) {
+        switch (pos->part) {
+            case PART_TITLE:
+                len += sprintf(buf + len,
+                               "<head><meta content=\"text/html; charset=UTF-8\" http-equiv=\"Content-Type\"><title>%s:%d%s</title></head>\n"
+                               "<body bgcolor=white text=black link=darkblue vlink=firebrick>\n"
+                               "<h1>listing: \n",
+                               req->hostname, tcp_port, req->path);
+                pos->h1   = req->path;
+                pos->h2   = req->path + 1;
+                pos->part = PART_CRUMBS;
+                break;
+            case PART_CRUMBS:
+                len += sprintf(buf + len, "<a href=\"%s\">%*.*s</a>",
+                               quote((unsigned char *) req->path, pos->h2 - req->path),
+                               (int)(pos->h2 - pos->h1),
+                               (int)(pos->h2 - pos->h1),
+                               pos->h1);
+                pos->h1 = pos->h2;
+
+                if (NULL == (pos->h2 = strchr(pos->h2, '/'))) {
+                    pos->part = PART_TABLE;
+                } else {
+                    pos->h2++;
+                }
+
+                break;
+            case PART_TABLE:
+                len += sprintf(buf + len,
+                               "</h1><hr noshade size=1><pre>\n"
+                               "<b>access      user      group     date             "
+                               "size  name</b>\n\n");
+                pos->i    = view->first;
+                pos->part = PART_ROWS;
+                break;
+            case PART_ROWS:
+
+                if (pos->i >= view->end) {
+                    pos->part = PART_PAGES;
+                    break;
+                }
+
+                len += ls_row(buf + len, view_row(view, pos->i++));
+                break;
+            case PART_PAGES:
+
+                if (view->limit > 0 && view->first > 0) {
+                    len += sprintf(buf + len, "\n<a href=\"?offset=%d&amp;limit=%d&amp;"
+                                   "sort=%s&amp;order=%s\">&lt;&lt; previous</a>",
+                                   view->first > view->limit ? view->first - view->limit : 0,
+                                   view->limit, sorts[view->sort],
+                                   view->desc ? "desc" : "asc");
+                }
+
+                if (view->limit > 0 && view->end < view->count) {
+                    len += sprintf(buf + len, "\n<a href=\"?offset=%d&amp;limit=%d&amp;"
+                                   "sort=%s&amp;order=%s\">next &gt;&gt;</a>",
+                                   view->end, view->limit, sorts[view->sort],
+                                   view->desc ? "desc" : "asc");
+                }
+
+                pos->part = PART_FOOT;
+                break;
+            case PART_FOOT:
+                strftime(date, sizeof(date), "%d/%b/%Y %H:%M:%S GMT", gmtime_r(&now, &tm));
+                len += sprintf(buf + len,
+                               "</pre><hr noshade size=1>\n"
+                               "<small><a href=\"%s\">%s</a> &nbsp; %s</small>\n"
+                               "</body>\n",
+                               HOMEPAGE, server_name, date);
+                pos->part = PART_DONE;
+                break;
         }
+    }
 
-        if (len + (LS_ALLOC_SIZE >> 2) > size) {
-            size += LS_ALLOC_SIZE;
-            re2 = realloc(buf, size);
+    return len;
+}
 
-            if (NULL == re2) {
-                goto oom;
-            }
+/*
+ * Json is an object with the path, the offset of the "next" page if
+ * there is one, and the "entries"; ndjson is just the entries, one per
+ * line.  Both leave out "..", which sync clients have no use for.
+ */
+static int render_json(struct REQUEST *req, struct LSVIEW *view,
+                       struct LSPOS *pos, char *buf, int size)
+{
+    struct myfile *f;
+    int nd = LIST_NDJSON == view->format, len = 0;
 
-            buf = re2;
-        }
+    while (pos->part != PART_DONE && size - len >= LS_MAX_ROW) {
+        switch (pos->part) {
+            case PART_TITLE:
 
-        /* mode */
-        strmode(files[i]->s.st_mode, buf + len);
-        len += 10;
-        buf[len++] = ' ';
-        buf[len++] = ' ';
-        /* user */
-        pw = xgetpwuid(files[i]->s.st_uid);
+                if (!nd) {
+                    len += sprintf(buf + len, "{\"path\":");
+                    len += json_str(buf + len, req->path, LS_MAX_ROW - 64);
 
-        if (NULL != pw) {
-            len += sprintf(buf + len, "%-8.8s  ", pw);
-        } else {
-            len += sprintf(buf + len, "%8d  ", (int)files[i]->s.st_uid);
-        }
+                    if (view->limit > 0 && view->end < view->count) {
+                        len += sprintf(buf + len, ",\"next\":%d", view->end);
+                    }
 
-        /* group */
-        gr = xgetgrgid(files[i]->s.st_gid);
+                    len += sprintf(buf + len, ",\"entries\":[");
+                }
 
-        if (NULL != gr) {
-            len += sprintf(buf + len, "%-8.8s  ", gr);
-        } else {
-            len += sprintf(buf + len, "%8d  ", (int)files[i]->s.st_gid);
-        }
+                pos->i    = view->first;
+                pos->rows = 0;
+                pos->part = PART_ROWS;
+                break;
+            case PART_ROWS:
 
-        /* mtime */
-        if (now - files[i]->s.st_mtime > 60 * 60 * 24 * 30 * 6)
-            len += strftime(buf + len, 255, "%b %d  %Y  ",
-                            gmtime(&files[i]->s.st_mtime));
-        else
-            len += strftime(buf + len, 255, "%b %d %H:%M  ",
-                            gmtime(&files[i]->s.st_mtime));
-
-        /* size */
-        if (S_ISDIR(files[i]->s.st_mode)) {
-            len += sprintf(buf + len, "  &lt;DIR&gt;  ");
-        } else if (!S_ISREG(files[i]->s.st_mode)) {
-            len += sprintf(buf + len, "     --  ");
-        } else if (files[i]->s.st_size < 1024 * 9) {
-            len += sprintf(buf + len, "%4d  B  ",
-                           (int)files[i]->s.st_size);
-        } else if (files[i]->s.st_size < 1024 * 1024 * 9) {
-            len += sprintf(buf + len, "%4d kB  ",
-                           (int)(files[i]->s.st_size >> 10));
-        } else if ((int64_t)(files[i]->s.st_size) < (int64_t)1024 * 1024 * 1024 * 9) {
-            len += sprintf(buf + len, "%4d MB  ",
-                           (int)(files[i]->s.st_size >> 20));
-        } else if ((int64_t)(files[i]->s.st_size) < (int64_t)1024 * 1024 * 1024 * 1024 * 9) {
-            len += sprintf(buf + len, "%4d GB  ",
-                           (int)(files[i]->s.st_size >> 30));
-        } else {
-            len += sprintf(buf + len, "%4d TB  ",
-                           (int)(files[i]->s.st_size >> 40));
-        }
+                if (pos->i >= view->end) {
+                    pos->part = PART_FOOT;
+                    break;
+                }
 
-        /* filename */
-        if (files[i]->r) {
-            len += sprintf(buf + len, "<a href=\"%s%s\">%s</a>\n",
-                           quote((unsigned char *) files[i]->n, 9999),
-                           S_ISDIR(files[i]->s.st_mode) ? "/" : "",
-                           files[i]->n);
-        } else {
-            len += sprintf(buf + len, "%s\n", files[i]->n);
+                f = view_row(view, pos->i++);
+
+                if (0 == strcmp(f->n, "..")) {
+                    break;
+                }
+
+                if (!nd) {
+                    len += sprintf(buf + len, pos->rows > 0 ? ",\n" : "\n");
+                }
+
+                len += json_row(buf + len, f);
+
+                if (nd) {
+                    buf[len++] = '\n';
+                }
+
+                pos->rows++;
+                break;
+            default:
+
+                if (!nd) {
+                    len += sprintf(buf + len, "\n]}\n");
+                }
+
+                pos->part = PART_DONE;
+                break;
         }
     }
 
-    strftime(line, 32, "%d/%b/%Y %H:%M:%S GMT", gmtime(&now));
-    len += sprintf(buf + len,
-                   "</pre><hr noshade size=1>\n"
-                   "<small><a href=\"%s\">%s</a> &nbsp; %s</small>\n"
-                   "</body>\n",
-                   HOMEPAGE, server_name, line);
+    return len;
+}
 
-    for (i = 0; i < count; i++) {
-        free(files[i]);
+/*
+ * Render the listing from >pos< on into buf, one piece (title, link,
+ * row, ...) at a time as long as LS_MAX_ROW bytes are left.  Returns the
+ * bytes written, pos->part is PART_DONE once everything is.
+ */
+static int render(struct REQUEST *req, struct LSVIEW *view,
+                  struct LSPOS *pos, char *buf, int size)
+{
+    if (LIST_HTML == view->format) {
+        return render_html(req, view, pos, buf, size);
     }
 
-    if (count) {
-        free(files);
+    return render_json(req, view, pos, buf, size);
+}
+
+/* the complete default listing in one buffer, for the cache */
+static char *ls(struct REQUEST *req, struct myfile **files, int count, int ndirs,
+                int format, int *length)
+{
+    struct LSVIEW view = { files, count, ndirs, 0, count, 0, SORT_NAME, 0, format };
+    struct LSPOS  pos = { PART_TITLE };
+    char *buf = NULL, *re;
+    int  len = 0, size = 0;
+
+    while (pos.part != PART_DONE) {
+        if (size - len < LS_MAX_ROW) {
+            size += LS_ALLOC_SIZE;
+
+            if (NULL == (re = realloc(buf, size))) {
+                fprintf(stderr, "oom\n");
+                free(buf);
+                return NULL;
+            }
+
+            buf = re;
+        }
+
+        len += render(req, &view, &pos, buf + len, size - len);
     }
 
-    /* return results */
     *length = len;
     return buf;
-oom:
-    fprintf(stderr, "oom\n");
+}
 
-    if (files) {
-        for (i = 0; i < count; i++)
-            if (files[i]) {
-                free(files[i]);
-            }
+/*
+ * The listing cache: a hash map keyed by directory path, split into
+ * DC_SHARDS shards by the hash so workers listing different directories
+ * don't wait for each other.  Each shard has its own lock, buckets and
+ * lru list and gets an equal slice of the max_dircache byte budget.  An
+ * entry is built once (outside the lock, later requests wait for it)
+ * and stays until its directory changes or the lru pushes it out.  A
+ * change is either reported by watch.c or, for entries built without a
+ * watch, seen by comparing the directory's mtime; those are also dropped
+ * once they are MAX_CACHE_AGE old.  Requests hold a reference, the cache
+ * one more as long as the entry is listed.
+ */
+
+#define DC_SHARDS   16                  /* power of two */
+#define DC_BUCKETS  256                 /* per shard, power of two */
+
+struct DIRSHARD {
+    pthread_mutex_t lock;
+    struct DIRCACHE *buckets[DC_BUCKETS];
+    struct DIRCACHE *lru_head, *lru_tail;   /* most recent first */
+    off_t           bytes;
+    int             entries;
+    unsigned long   hits, misses, stale, evictions, invalidated;
+} __attribute__((aligned(64)));
+
+static struct DIRSHARD shards[DC_SHARDS];
+
+static struct DIRSHARD *shard_of(unsigned int hash)
+{
+    return &shards[(hash >> 24) & (DC_SHARDS - 1)];
+}
 
-        free(files);
-    }
+/* --- everything below with the shard lock held ------------------------ */
+
+static struct DIRCACHE *lookup(struct DIRSHARD *sh, char *path, unsigned int hash)
+{
+    struct DIRCACHE *this;
 
-    if (buf) {
-        free(buf);
+    for (this = sh->buckets[hash & (DC_BUCKETS - 1)]; NULL != this; this = this->hnext) {
+        if (this->hash == hash && 0 == strcmp(path, this->path)) {
+            return this;
+        }
     }
 
     return NULL;
 }
 
-struct DIRCACHE *dirs = NULL;
+static void lru_unlink(struct DIRSHARD *sh, struct DIRCACHE *dir)
+{
+    if (dir->prev) {
+        dir->prev->next = dir->next;
+    } else {
+        sh->lru_head = dir->next;
+    }
 
-void free_dir(struct DIRCACHE *dir)
+    if (dir->next) {
+        dir->next->prev = dir->prev;
+    } else {
+        sh->lru_tail = dir->prev;
+    }
+}
+
+static void lru_push(struct DIRSHARD *sh, struct DIRCACHE *dir)
+{
+    dir->prev = NULL;
+    dir->next = sh->lru_head;
+
+    if (sh->lru_head) {
+        sh->lru_head->prev = dir;
+    } else {
+        sh->lru_tail = dir;
+    }
+
+    sh->lru_head = dir;
+}
+
+static void release(struct DIRCACHE *dir)
 {
-    DO_LOCK(dir->lock_refcount);
-    dir->refcount--;
+    int i;
 
-    if (dir->refcount > 0) {
-        DO_UNLOCK(dir->lock_refcount);
+    if (--dir->refcount > 0) {
         return;
     }
 
-    DO_UNLOCK(dir->lock_refcount);
-    FREE_LOCK(dir->lock_refcount);
     FREE_LOCK(dir->lock_reading);
     FREE_COND(dir->wait_reading);
 
-    if (NULL != dir->html) {
-        free(dir->html);
+    for (i = 0; i < LIST_FORMATS; i++) {
+        free(dir->body[i]);
+        free(dir->gz[i]);
+    }
+
+    for (i = 1; i < SORT_KEYS; i++) {
+        free(dir->order[i]);
+    }
+
+    if (dir->files) {
+        free_files(dir->files, dir->nfiles);
     }
 
     free(dir);
 }
 
-struct DIRCACHE *get_dir(struct REQUEST *req, char *filename) {
-    struct DIRCACHE  *this, *prev;
-    int              i;
+/* take dir out of the cache, it lives on until the last request is done */
+static void drop(struct DIRSHARD *sh, struct DIRCACHE *dir)
+{
+    struct DIRCACHE **p;
 
-    DO_LOCK(lock_dircache);
+    for (p = &sh->buckets[dir->hash & (DC_BUCKETS - 1)]; *p != dir; p = &(*p)->hnext)
+        ;
 
-    for (prev = NULL, this = dirs, i = 0; this != NULL;
-         prev = this, this = this->next, i++) {
-        if (0 == strcmp(filename, this->path)) {
-            /* remove from list */
-            if (NULL == prev) {
-                dirs = this->next;
-            } else {
-                prev->next = this->next;
-            }
+    *p = dir->hnext;
+    lru_unlink(sh, dir);
+    sh->bytes -= dir->bytes;
+    sh->entries--;
+    dir->cached = 0;
+    release(dir);
+}
 
-            break;
+/* account bytes for a cached entry and evict down to the budget */
+static void charge(struct DIRSHARD *sh, struct DIRCACHE *dir, off_t bytes)
+{
+    if (!dir->cached) {
+        return;
+    }
+
+    dir->bytes += bytes;
+    sh->bytes  += bytes;
+
+    while (sh->bytes > max_dircache / DC_SHARDS && sh->lru_tail != dir) {
+        sh->evictions++;
+        drop(sh, sh->lru_tail);
+    }
+}
+
+/* --------------------------------------------------------------------- */
+
+void free_dir(struct DIRCACHE *dir)
+{
+    struct DIRSHARD *sh = shard_of(dir->hash);
+
+    DO_LOCK(sh->lock);
+    release(dir);
+    DO_UNLOCK(sh->lock);
+}
+
+/*
+ * The default view of req->dir in req->list_format, NULL if the directory
+ * is too big to keep it (see next_stream()).  The html one is made with
+ * the entry, the json ones by the first request asking for them.
+ */
+char *get_dir_body(struct REQUEST *req, int *length)
+{
+    struct DIRCACHE *dir = req->dir;
+    struct DIRSHARD *sh;
+    int  format = req->list_format;
+    char *body;
+
+    DO_LOCK(dir->lock_reading);
+
+    if (NULL == dir->body[format] && dir->nfiles <= LS_STREAM &&
+        NULL != (dir->body[format] = ls(req, dir->files, dir->nfiles, dir->ndirs,
+                                        format, &dir->length[format]))) {
+        sh = shard_of(dir->hash);
+        DO_LOCK(sh->lock);
+        charge(sh, dir, dir->length[format]);
+        DO_UNLOCK(sh->lock);
+    }
+
+    body    = dir->body[format];
+    *length = dir->length[format];
+    DO_UNLOCK(dir->lock_reading);
+    return body;
+}
+
+/* a listing body gzip'ed, compressed by the first request asking for it */
+char *get_dir_gz(struct DIRCACHE *dir, int format, int *length)
+{
+    struct DIRSHARD *sh;
+
+    DO_LOCK(dir->lock_reading);
+
+    if (0 == dir->gzlength[format] && NULL != dir->body[format]) {
+        dir->gz[format] = gzip(dir->body[format], dir->length[format],
+                               &dir->gzlength[format]);
+
+        if (dir->gzlength[format] > 0) {
+            sh = shard_of(dir->hash);
+            DO_LOCK(sh->lock);
+            charge(sh, dir, dir->gzlength[format]);
+            DO_UNLOCK(sh->lock);
         }
+    }
 
-        if (i > max_dircache) {
-            free_dir(this);
-            this = NULL;
-            prev->next = NULL;
-            break;
+    *length = dir->gzlength[format];
+    DO_UNLOCK(dir->lock_reading);
+    return dir->gz[format];
+}
+
+/*
+ * Streaming a listing: the rows of a big directory, or of a sorted or
+ * paged view of any directory, are rendered while the response goes out,
+ * LS_STREAM_BUF bytes at a time, each piece sent as one chunk (or plain,
+ * connection closing, for HTTP/1.0 clients).  The cache keeps the
+ * entries, and each other order once a request asked for it.
+ */
+
+struct LSSTREAM {
+    struct LSVIEW view;
+    struct LSPOS pos;
+    int          done;              /* last piece rendered */
+    char         *out;              /* current piece, with chunk framing */
+    int          len;
+    char         data[LS_STREAM_BUF];
+};
+
+/* dir's entries in order >key<, sorted by the first request asking */
+static struct myfile **get_order(struct DIRCACHE *dir, int key)
+{
+    static int (*compare[SORT_KEYS])(const void *, const void *) = {
+        compare_files, compare_size, compare_mtime
+    };
+    struct DIRSHARD *sh;
+    struct myfile   **order;
+
+    DO_LOCK(dir->lock_reading);
+
+    if (NULL == (order = dir->order[key]) &&
+        NULL != (order = malloc(dir->nfiles * sizeof(*order) + 1))) {
+        memcpy(order, dir->files, dir->nfiles * sizeof(*order));
+        qsort(order, dir->nfiles, sizeof(*order), compare[key]);
+        dir->order[key] = order;
+        sh = shard_of(dir->hash);
+        DO_LOCK(sh->lock);
+        charge(sh, dir, dir->nfiles * sizeof(*order));
+        DO_UNLOCK(sh->lock);
+    }
+
+    DO_UNLOCK(dir->lock_reading);
+    return order;
+}
+
+int open_stream(struct REQUEST *req)
+{
+    struct DIRCACHE *dir = req->dir;
+    struct LSVIEW   *v;
+
+    if (NULL == (req->stream = malloc(sizeof(struct LSSTREAM)))) {
+        return -1;
+    }
+
+    v = &req->stream->view;
+
+    if (NULL == (v->files = get_order(dir, req->list_sort))) {
+        close_stream(req);
+        return -1;
+    }
+
+    v->count  = dir->nfiles;
+    v->ndirs  = dir->ndirs;
+    v->first  = req->list_offset < v->count ? req->list_offset : v->count;
+    v->end    = v->count;
+    v->desc   = req->list_desc;
+    v->sort   = req->list_sort;
+    v->limit  = req->list_limit;
+    v->format = req->list_format;
+
+    if (v->limit > 0 && v->limit < v->end - v->first) {
+        v->end = v->first + v->limit;
+    }
+
+    req->stream->pos.part = PART_TITLE;
+    req->stream->done     = 0;
+    req->stream->len      = 0;
+    req->chunked = 1 == req->major && req->minor >= 1;
+
+    if (!req->chunked) {
+        req->keep_alive = 0;
+    }
+
+    return 0;
+}
+
+void close_stream(struct REQUEST *req)
+{
+    free(req->stream);
+    req->stream  = NULL;
+    req->chunked = 0;
+}
+
+/* the unsent part of the current piece, rendering the next one when it
+ * is gone */
+off_t next_stream(struct REQUEST *req, char **buf)
+{
+    struct LSSTREAM *s = req->stream;
+    char hex[16];
+    int  len, n;
+
+    if (req->written == s->len && !s->done) {
+        /* leave room for "<hex>\r\n" in front and "\r\n0\r\n\r\n" behind */
+        s->out = s->data + sizeof(hex);
+        len = render(req, &s->view, &s->pos, s->out, sizeof(s->data) - sizeof(hex) - 7);
+        s->done = s->pos.part == PART_DONE;
+
+        if (req->chunked && len > 0) {
+            n = sprintf(hex, "%x\r\n", len);
+            s->out -= n;
+            memcpy(s->out, hex, n);
+            memcpy(s->out + n + len, "\r\n", 2);
+            len += n + 2;
         }
+
+        if (req->chunked && s->done) {
+            memcpy(s->out + len, "0\r\n\r\n", 5);
+            len += 5;
+        }
+
+        s->len = len;
+        req->written = 0;
     }
 
-    if (this) {
+    *buf = s->out + req->written;
+    return s->len - req->written;
+}
+
+/* more pieces after the current one? */
+int stream_more(struct REQUEST *req)
+{
+    return !req->stream->done;
+}
+
+/* is everything sent? */
+int stream_done(struct REQUEST *req)
+{
+    return req->stream->done && req->written == req->stream->len;
+}
+
+/*
+ * The listing of directory >filename<, NULL with errno set if it can't
+ * be stat()ed or there is no memory for it.  A listing built while its
+ * directory was watched is good until watch.c reports a change, so a hit
+ * doesn't touch the filesystem at all; other ones are checked against
+ * the directory's mtime.
+ */
+struct DIRCACHE *get_dir(struct REQUEST *req, char *filename)
+{
+    struct DIRCACHE  *this;
+    struct DIRSHARD  *sh;
+    unsigned int     hash = hash_path(filename);
+    unsigned long    gen = watch_generation();
+    struct myfile    **files;
+    off_t            bytes = 0;
+    int              len, count, watched = 0;
+    struct tm        tm;
+
+    sh = shard_of(hash);
+    DO_LOCK(sh->lock);
+    this = lookup(sh, filename, hash);
+
+    if (NULL == this || !this->watched) {
+        DO_UNLOCK(sh->lock);
+
+        /* watch first, so no change after the stat() goes unnoticed */
+        watched = 0 == watch_dir(filename);
+
+        if (-1 == stat(filename, req->bst)) {
+            return NULL;
+        }
+
+        strftime(req->mtime, sizeof(req->buf->mtime), RFC1123,
+                 gmtime_r(&req->bst->st_mtime, &tm));
+        DO_LOCK(sh->lock);
+        this = lookup(sh, filename, hash);
+
         /* check mtime and cache entry age */
-        if (now - this->add > MAX_CACHE_AGE || 0 != strcmp(this->mtime, req->mtime)) {
-            free_dir(this);
+        if (this && !this->watched &&
+            (now - this->add > MAX_CACHE_AGE || 0 != strcmp(this->mtime, req->mtime))) {
+            sh->stale++;
+            drop(sh, this);
             this = NULL;
         }
     }
 
     if (!this) {
-        /* add a new cache entry to the list */
-        this = malloc(sizeof(struct DIRCACHE));
+        /* add a new cache entry, listed right away so concurrent
+         * requests wait for this one instead of building their own */
+        sh->misses++;
+        len = strlen(filename);
+
+        if (NULL == (this = malloc(sizeof(struct DIRCACHE) + len + 1))) {
+            DO_UNLOCK(sh->lock);
+            fprintf(stderr, "oom\n");
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        this->path = (char *)(this + 1);
+        memcpy(this->path, filename, len + 1);
+        this->hash     = hash;
         this->refcount = 2;
-        this->reading = 1;
-        INIT_LOCK(this->lock_refcount);
+        this->reading  = 1;
+        this->cached   = 1;
+        this->watched  = 0;
+        this->bytes    = 0;
+        memset(this->body, 0, sizeof(this->body));
+        memset(this->length, 0, sizeof(this->length));
+        this->files    = NULL;
+        this->nfiles   = 0;
+        this->ndirs    = 0;
+        memset(this->order, 0, sizeof(this->order));
+        memset(this->gz, 0, sizeof(this->gz));
+        memset(this->gzlength, 0, sizeof(this->gzlength));
         INIT_LOCK(this->lock_reading);
         INIT_COND(this->wait_reading);
-        this->next = dirs;
-        dirs = this;
-        DO_UNLOCK(lock_dircache);
-        strcpy(this->path,  filename);
+        this->st = *req->bst;
         strcpy(this->mtime, req->mtime);
-        this->add   = now;
-        this->html  = ls(now, req->hostname, filename, req->path, &(this->length));
+        this->add    = now;
+        this->policy = get_policy(req->path, req->mime);
+
+        snprintf(this->etag, sizeof(this->etag), "\"d%lx-%lx\"",
+                 (unsigned long) dir_epoch,
+                 __atomic_add_fetch(&dir_generation, 1, __ATOMIC_RELAXED));
+        this->hnext = sh->buckets[hash & (DC_BUCKETS - 1)];
+        sh->buckets[hash & (DC_BUCKETS - 1)] = this;
+        lru_push(sh, this);
+        sh->entries++;
+        DO_UNLOCK(sh->lock);
+
+        if (NULL != (files = scan_dir(filename, req->path, &count, &bytes))) {
+            this->files  = files;
+            this->nfiles = count;
+            this->order[SORT_NAME] = files;
+
+            while (this->ndirs < count && S_ISDIR(files[this->ndirs]->mode)) {
+                this->ndirs++;
+            }
+
+            if (count <= LS_STREAM) {
+                /* small enough to keep the default view ready, bigger
+                 * ones are rendered while sent, see next_stream() */
+                this->body[LIST_HTML] = ls(req, files, count, this->ndirs, LIST_HTML,
+                                           &(this->length[LIST_HTML]));
+                bytes += this->length[LIST_HTML];
+            }
+        }
+
+        DO_LOCK(sh->lock);
+
+        if (NULL == this->files) {
+            /* don't remember failures */
+            if (this->cached) {
+                drop(sh, this);
+            }
+        } else {
+            /* trust it only if nothing changed while we were reading */
+            this->watched = watched && gen == watch_generation();
+            charge(sh, this, sizeof(struct DIRCACHE) + len + 1 + bytes);
+        }
+
+        DO_UNLOCK(sh->lock);
         DO_LOCK(this->lock_reading);
         this->reading = 0;
         BCAST_COND(this->wait_reading);
         DO_UNLOCK(this->lock_reading);
     } else {
-        /* add back to the list */
-        this->next = dirs;
-        dirs = this;
+        sh->hits++;
+        lru_unlink(sh, this);
+        lru_push(sh, this);
         this->refcount++;
-        DO_UNLOCK(lock_dircache);
+        *req->bst = this->st;
+        strcpy(req->mtime, this->mtime);
+        DO_UNLOCK(sh->lock);
         DO_LOCK(this->lock_reading);
 
-        if (this->reading) {
+        while (this->reading) {
             WAIT_COND(this->wait_reading, this->lock_reading);
         }
 
         DO_UNLOCK(this->lock_reading);
     }
 
-    req->body  = this->html;
-    req->lbody = this->length;
     return this;
 }
+
+/* called by watch.c when something in directory >path< changed */
+void dir_changed(char *path)
+{
+    struct DIRCACHE *this;
+    struct DIRSHARD *sh;
+    unsigned int    hash = hash_path(path);
+
+    sh = shard_of(hash);
+    DO_LOCK(sh->lock);
+
+    if (NULL != (this = lookup(sh, path, hash))) {
+        sh->invalidated++;
+        drop(sh, this);
+    }
+
+    DO_UNLOCK(sh->lock);
+}
+
+void flush_dirs(void)
+{
+    int i;
+
+    for (i = 0; i < DC_SHARDS; i++) {
+        DO_LOCK(shards[i].lock);
+
+        while (NULL != shards[i].lru_tail) {
+            shards[i].invalidated++;
+            drop(&shards[i], shards[i].lru_tail);
+        }
+
+        DO_UNLOCK(shards[i].lock);
+    }
+}
+
+void dir_stats(char *buf, int size)
+{
+    unsigned long hits = 0, misses = 0, stale = 0, evictions = 0, invalidated = 0;
+    off_t bytes = 0;
+    int   i, entries = 0;
+
+    for (i = 0; i < DC_SHARDS; i++) {
+        DO_LOCK(shards[i].lock);
+        entries     += shards[i].entries;
+        bytes       += shards[i].bytes;
+        hits        += shards[i].hits;
+        misses      += shards[i].misses;
+        stale       += shards[i].stale;
+        evictions   += shards[i].evictions;
+        invalidated += shards[i].invalidated;
+        DO_UNLOCK(shards[i].lock);
+    }
+
+    snprintf(buf, size, "%d listings (%" PRId64 " bytes), %lu hits, %lu misses, "
+             "%lu stale, %lu invalidated, %lu evicted", entries, (int64_t) bytes,
+             hits, misses, stale, invalidated, evictions);
+}
+
+void init_dircache(void)
+{
+    pthread_t helper;
+    int       i;
+
+    dir_epoch = time(NULL);
+
+    /* stat helpers for big directories, not worth it on a single cpu */
+    nhelpers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (nhelpers > LS_HELPERS) {
+        nhelpers = LS_HELPERS;
+    }
+
+    for (i = 0; i < nhelpers; i++) {
+        if (0 != pthread_create(&helper, NULL, stat_helper, NULL)) {
+            nhelpers = i;
+            break;
+        }
+    }
+
+    for (i = 0; i < DC_SHARDS; i++) {
+        INIT_LOCK(shards[i].lock);
+    }
+}
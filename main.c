@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,22 +8,56 @@
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <linux/io_uring.h>
 
 #include "httpd.h"
 
+#define MAX_EVENTS 64
+#define MAX_RING   4096         /* sqes, uring_get_sqe() flushes when full */
+#define FD_SLACK   64           /* listeners, inotify, logs, ... */
+#define PIPE_CHUNK (64 * 1024)
+
+/* io_uring user_data tags, anything else is a struct REQUEST */
+#define UD_ACCEPT   0
+#define UD_LISTEN   1
+#define UD_IGNORE   2
+
+/* io_uring operations in flight (req->op) */
+#define OP_RECV         1
+#define OP_SEND         2
+#define OP_SPLICE_IN    3
+#define OP_SPLICE_OUT   4
+#define OP_POLL         5
+
 char *server_name   = "gx-0.01";
 
 int  timeout        = 60;
 int  keepalive_time = 5;
 int  tcp_port       = 0;
-int  max_dircache   = 128;
-int  max_conn       = 10;
+int  max_ranges     = 16;
+int  max_filecache  = 256;
+off_t max_memfile   = 16384;
+off_t max_memcache  = 32 * 1024 * 1024;
+off_t max_dircache  = 8 * 1024 * 1024;
+int  gzip_level     = 0;
+int  gzip_min       = 1024;
+int  gzip_budget    = 100;
+int  max_conn       = 0;          /* per worker, 0: from RLIMIT_NOFILE */
 int  nthreads       = 4;
+int  reuseport      = 0;
+int  use_uring      = 0;
+int  use_inotify    = 1;
 char *doc_root      = ".";
+char *mime_file     = "/etc/mime.types";
 char *listen_ip     = NULL;
 char *listen_port   = "8000";
 char user[17];
@@ -30,7 +65,6 @@ char group[17];
 
 time_t  now;
 int     slisten;
-char time_buf[64];
 
 pthread_t *threads;
 static int termsig, got_sighup;
@@ -50,14 +84,10 @@ static void catchsig(int sig)
     }
 }
 
-char *get_time(void)
+/* a SIGHUP came in?  Every worker asks, the first one gets it */
+static int take_sighup(void)
 {
-    struct tm *newtime;
-    time_t aclock;
-    time(&aclock);
-    newtime = localtime(&aclock);
-    strftime(time_buf, 64, "%F %T", newtime);
-    return time_buf;
+    return __atomic_exchange_n(&got_sighup, 0, __ATOMIC_ACQ_REL);
 }
 
 static void usage(char *name)
@@ -70,9 +100,32 @@ static void usage(char *name)
            "\n"
            "Options:\n"
            "  -h       print this text\n"
-           "  -p port  use tcp-port >port<                 [%s]\n",
+           "  -p port  use tcp-port >port<                 [%s]\n"
+           "  -t n     run >n< worker threads              [%d]\n"
+           "  -n n     accept up to >n< connections per\n"
+           "           thread                    [ulimit -n]\n"
+           "  -r       one SO_REUSEPORT listener and cpu\n"
+           "           per thread, SIGHUP dumps accept counts\n"
+           "  -u       use the io_uring engine (falls back\n"
+           "           to epoll if the kernel lacks support)\n"
+           "  -R n     answer up to >n< byte ranges per\n"
+           "           request, the whole file beyond  [%d]\n"
+           "  -m n     serve files up to >n< bytes from\n"
+           "           memory, 0 turns this off            [%d]\n"
+           "  -z n     gzip listings and small text files\n"
+           "           on the fly with level >n<, at most\n"
+           "           %d ms cpu per second            [off]\n"
+           "  -c file  read Cache-Control policies per path\n"
+           "           prefix or mime type from >file<\n"
+           "  -M file  read mime types from >file<\n"
+           "           [%s]\n"
+           "  -L n     keep up to >n< bytes of directory\n"
+           "           listings cached                     [%d]\n"
+           "  -i       don't watch the served files with\n"
+           "           inotify, revalidate them with stat()\n",
            h ? h + 1 : name,
-           listen_port);
+           listen_port, nthreads, max_ranges, (int) max_memfile, gzip_budget, mime_file,
+           (int) max_dircache);
     exit(1);
 }
 
@@ -129,119 +182,471 @@ int host_info(void)
 }
 #endif
 
-static void *mainloop(void *thread_arg)
+/* per-thread event loop state */
+struct WORKER {
+    int             id;
+    int             cpu;            /* pinned to, -1 if not */
+    int             lfd;            /* listening socket */
+    int             efd;            /* epoll instance */
+    int             listening;      /* lfd registered with efd? */
+    unsigned long   accepts;
+    int             curr_conn;
+    uint64_t        msec;           /* mono_msec() after the last wait */
+    struct WHEEL    wheel;          /* connection timeouts */
+    struct POOL     pool;           /* recycled REQUESTs */
+    struct REQUEST  *conns;
+
+    /* io_uring engine */
+    int             uring;          /* use ring instead of efd */
+    struct URING    ring;
+    int             accepting;      /* accept (or poll on lfd) queued */
+};
+
+static struct WORKER *workers;
+
+/* epoll interest for the current request state */
+static int state_events(struct REQUEST *req)
 {
-    struct REQUEST *conns = NULL;
-    int curr_conn = 0;
-    struct REQUEST      *req, *prev, *tmp;
-    struct timeval      tv;
-    int                 max;
-    socklen_t           length;
-    fd_set              rd, wr;
+    switch (req->state) {
+        case STATE_KEEPALIVE:
+        case STATE_READ_HEADER:
+            return EPOLLIN;
+        case STATE_WRITE_HEADER:
+        case STATE_WRITE_BODY:
+        case STATE_WRITE_FILE:
+        case STATE_WRITE_RANGES:
+        case STATE_WRITE_STREAM:
+            return EPOLLOUT;
+    }
 
-    for (; !termsig;) {
-        if (got_sighup) {
-            got_sighup = 0;
+    return 0;
+}
+
+static void uring_accept(struct WORKER *w, int opcode);
+static void uring_arm(struct WORKER *w, struct REQUEST *req);
+
+static void listen_on(struct WORKER *w, int on)
+{
+    struct epoll_event ev;
+
+    if (on == w->listening) {
+        return;
+    }
+
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+
+    if (-1 == epoll_ctl(w->efd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, w->lfd, &ev)) {
+        perror("epoll_ctl");
+        return;
+    }
+
+    w->listening = on;
+}
+
+/* drop the io_uring splice pipe, uring_arm() makes a new one on demand */
+static void close_pipe(struct REQUEST *req)
+{
+    if (req->pipefd[0] != -1) {
+        close(req->pipefd[0]);
+        close(req->pipefd[1]);
+        req->pipefd[0] = -1;
+        req->pipefd[1] = -1;
+    }
+}
+
+static void close_request(struct WORKER *w, struct REQUEST *req)
+{
+    timer_del(&w->wheel, &req->timer);
+
+    if (req->inflight) {
+        /* the ring still references req: make the pending operation
+         * fail quickly and finish the job when its completion arrives */
+        req->state = STATE_CLOSE;
+        shutdown(req->fd, SHUT_RDWR);
+        return;
+    }
+
+    close(req->fd);
+    close_pipe(req);
+
+    if (req->file) {
+        free_file(req->file);
+    }
+
+    if (req->stream) {
+        close_stream(req);
+    }
+
+    if (req->dir) {
+        free_dir(req->dir);
+    }
+
+    w->curr_conn--;
+    printf("%s:\tfd: %03d; current connections: %d\n", get_time(), req->fd, w->curr_conn);
+
+    /* unlink from list */
+    if (req->prev) {
+        req->prev->next = req->next;
+    } else {
+        w->conns = req->next;
+    }
+
+    if (req->next) {
+        req->next->prev = req->prev;
+    }
+
+    pool_put(&w->pool, req);
+
+    if (w->curr_conn < max_conn) {
+        if (w->uring) {
+            uring_accept(w, IORING_OP_ACCEPT);
+        } else {
+            listen_on(w, 1);
         }
+    }
+}
+
+/* cleanup after a finished request, keep the connection */
+static void reset_request(struct REQUEST *req)
+{
+    req->auth[0]       = 0;
+    req->if_modified   = NULL;
+    req->if_unmodified = NULL;
+    req->if_range      = NULL;
+    req->if_none_match = NULL;
+    req->range_hdr     = NULL;
+    req->ranges        = 0;
+    req->accept_enc    = 0;
+    req->list_view     = 0;
+    req->list_offset   = 0;
+    req->list_limit    = 0;
+    req->list_sort     = SORT_NAME;
+    req->list_desc     = 0;
+    req->list_format   = LIST_HTML;
+    req->encoding      = NULL;
+    req->vary          = 0;
+    req->policy        = NULL;
+
+    req->nhdr          = 0;
+    memset(req->mtime,   0, sizeof(req->buf->mtime));
+    req->etag[0] = 0;
+
+    if (req->file) {
+        free_file(req->file);
+        req->file = NULL;
+        req->bfd  = -1;
+    }
+
+    req->body      = NULL;
+    req->written   = 0;
+    req->head_only = 0;
+    req->rh        = 0;
+    req->rb        = 0;
 
-        FD_ZERO(&rd);
-        FD_ZERO(&wr);
-        max = 0;
+    if (req->stream) {
+        close_stream(req);
+    }
 
-        /* add listening socket */
-        if (curr_conn < max_conn) {
-            FD_SET(slisten, &rd);
-            max = slisten;
+    if (req->dir) {
+        free_dir(req->dir);
+        req->dir = NULL;
+    }
+
+    req->hostname[0] = 0;
+    req->path[0]     = 0;
+    req->query[0]    = 0;
+    req->hscan       = 0;
+    req->hline       = 0;
+}
+
+/*
+ * Drive the request state machine after I/O: parse complete headers,
+ * recycle finished requests, close dead connections and finally point
+ * the epoll registration at the direction the new state waits for.
+ */
+static void handle_request(struct WORKER *w, struct REQUEST *req)
+{
+    struct epoll_event ev;
+    int events;
+
+    for (;;) {
+        /* header parsing */
+        if (req->state == STATE_PARSE_HEADER) {
+            parse_request(req);
+
+            /* the ring sends the header with the next submission */
+            if (req->state == STATE_WRITE_HEADER && !w->uring) {
+                write_request(req);
+            }
         }
 
-        /* add connection sockets */
-        for (req = conns; req != NULL; req = req->next) {
-            switch (req->state) {
-                case STATE_KEEPALIVE:
-                case STATE_READ_HEADER:
-                    FD_SET(req->fd, &rd);
+        /* handle finished requests */
+        if (req->state == STATE_FINISHED && !req->keep_alive) {
+            req->state = STATE_CLOSE;
+        }
 
-                    if (req->fd > max) {
-                        max = req->fd;
-                    }
+        if (req->state != STATE_FINISHED) {
+            break;
+        }
 
-                    break;
-                case STATE_WRITE_HEADER:
-                case STATE_WRITE_BODY:
-                case STATE_WRITE_FILE:
-                case STATE_WRITE_RANGES:
-                    FD_SET(req->fd, &wr);
+        reset_request(req);
+
+        /* a completely filled buffer may have left data in the socket,
+         * which edge triggered epoll would never report again */
+        if (req->hdata == req->lreq && req->hdata < MAX_HEADER) {
+            /* ok, wait for the next one ... unless we are busy */
+            req->state = (w->curr_conn > max_conn * 9 / 10) ? STATE_CLOSE : STATE_KEEPALIVE;
+            req->hdata = 0;
+            req->lreq  = 0;
+            pool_detach(&w->pool, req);
+            close_pipe(req);
+            break;
+        }
 
-                    if (req->fd > max) {
-                        max = req->fd;
-                    }
+        /* there is a pipelined request in the queue ... */
+        req->state = STATE_READ_HEADER;
+        memmove(req->hreq, req->hreq + req->lreq,
+                req->hdata - req->lreq);
+        req->hdata -= req->lreq;
+        req->lreq  =  0;
+        req->hreq[req->hdata] = 0;
 
-                    break;
+        if (w->uring) {
+            scan_request(req);
+        } else {
+            read_request(req, 1);
+        }
+    }
+
+    /* connections to close */
+    if (req->state == STATE_CLOSE) {
+        close_request(w, req);
+        return;
+    }
+
+    /* (re)start the timeout */
+    timer_set(&w->wheel, &req->timer, w->msec + 1000 *
+              (req->state == STATE_KEEPALIVE ? keepalive_time : timeout));
+
+    if (w->uring) {
+        uring_arm(w, req);
+        return;
+    }
+
+    /* switch between read and write interest; re-arming an edge
+     * triggered fd reports it again if it is ready already */
+    events = state_events(req);
+
+    if (0 == events || events == req->events) {
+        return;
+    }
+
+    ev.events   = events | EPOLLET;
+    ev.data.ptr = req;
+
+    if (-1 == epoll_ctl(w->efd, EPOLL_CTL_MOD, req->fd, &ev)) {
+        perror("epoll_ctl");
+        close_request(w, req);
+        return;
+    }
+
+    req->events = events;
+}
+
+/* setup a freshly accepted connection, NULL if it is gone already */
+static struct REQUEST *new_request(struct WORKER *w, int fd)
+{
+    struct REQUEST      *req;
+    struct sockaddr_storage peer;
+    char                peerhost[MAX_HOST+1];
+    socklen_t           length;
+
+    if (NULL == (req = pool_get(&w->pool))) {
+        close(fd);
+        return NULL;
+    }
+
+    req->fd = fd;
+    close_on_exec(req->fd);
+    fcntl(req->fd, F_SETFL, O_NONBLOCK);
+    req->bfd = -1;
+    req->pipefd[0] = -1;
+    req->pipefd[1] = -1;
+    req->state = STATE_READ_HEADER;
+    req->timer.data = req;
+    w->accepts++;
+
+    req->next = w->conns;
+
+    if (w->conns) {
+        w->conns->prev = req;
+    }
+
+    w->conns = req;
+    w->curr_conn++;
+
+    length = sizeof(peer);
+
+    if (-1 == getpeername(req->fd, (struct sockaddr *) &peer, &length)) {
+        close_request(w, req);
+        return NULL;
+    }
+
+    getnameinfo((struct sockaddr *)&peer, length,
+                peerhost, MAX_HOST, NULL, 0, NI_NUMERICHOST);
+    printf("%s:\tfd: %03d; connect from %s\n", get_time(), req->fd , peerhost);
+    return req;
+}
+
+static void accept_requests(struct WORKER *w)
+{
+    struct REQUEST      *req;
+    struct epoll_event  ev;
+    int                 fd;
+
+    /* edge triggered: take everything which is queued */
+    while (w->curr_conn < max_conn) {
+        if (-1 == (fd = accept(w->lfd, NULL, NULL))) {
+            if (EINTR == errno || ECONNABORTED == errno) {
+                continue;
             }
+
+            if (EAGAIN != errno) {
+                perror("accept");
+            }
+
+            break;
         }
 
-        /* go! */
-        tv.tv_sec  = keepalive_time;
-        tv.tv_usec = 0;
+        if (NULL == (req = new_request(w, fd))) {
+            continue;
+        }
 
-        if (-1 == select(max + 1, &rd, &wr, NULL, (curr_conn > 0) ? &tv : NULL)) {
-            perror("select");
+        timer_set(&w->wheel, &req->timer, w->msec + 1000 * timeout);
+
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = req;
+
+        if (-1 == epoll_ctl(w->efd, EPOLL_CTL_ADD, req->fd, &ev)) {
+            perror("epoll_ctl");
+            close_request(w, req);
             continue;
         }
 
-        now = time(NULL);
+        req->events = EPOLLIN;
+    }
 
-        /* new connection ? */
-        if (FD_ISSET(slisten, &rd)) {
-            req = malloc(sizeof(struct REQUEST));
+    if (w->curr_conn >= max_conn) {
+        listen_on(w, 0);
+    }
+}
 
-            if (NULL != req) {
-                memset(req, 0, sizeof(struct REQUEST));
+/* wheel callback: a connection was idle for too long */
+static void expire_request(void *data, void *arg)
+{
+    struct WORKER  *w = arg;
+    struct REQUEST *req = data;
 
-                if (-1 == (req->fd = accept(slisten, NULL, NULL))) {
-                    if (EAGAIN != errno) {
-                        free(req);
-                    }
-                } else {
-                    close_on_exec(req->fd);
-                    fcntl(req->fd, F_SETFL, O_NONBLOCK);
-                    req->bfd = -1;
-                    req->state = STATE_READ_HEADER;
-                    req->ping = now;
-                    req->next = conns;
-                    conns = req;
-                    curr_conn++;
-
-                    /* Make sure the request has not been cancelled!
-                     * Otherwise just ignore it. */
-                    if (req) {
-                        length = sizeof(req->peer);
-
-                        if (-1 == getpeername(req->fd, (struct sockaddr *) & (req->peer), &length)) {
-                            req->state = STATE_CLOSE;
-                        }
+    if (req->state == STATE_READ_HEADER && 0 == pool_attach(&w->pool, req)) {
+        mkerror(req, 408, 0);
+    } else {
+        req->state = STATE_CLOSE;
+    }
 
-                        getnameinfo((struct sockaddr *)&req->peer, length,
-                                    req->peerhost, MAX_HOST,
-                                    req->peerserv, MAX_MISC,
-                                    NI_NUMERICHOST | NI_NUMERICSERV);
-                        printf("%s:\tfd: %03d; connect from %s\n", get_time(), req->fd , req->peerhost);
-                    }
-                }
+    handle_request(w, req);
+}
+
+/* dump per-thread counters, triggered by SIGHUP */
+static void print_stats(void)
+{
+    char pool[256], files[192];
+    int i;
+
+    file_stats(files, sizeof(files));
+    printf("%s:\tfile cache: %s\n", get_time(), files);
+    dir_stats(files, sizeof(files));
+    printf("%s:\tlisting cache: %s\n", get_time(), files);
+    watch_stats(files, sizeof(files));
+    printf("%s:\tinotify: %s\n", get_time(), files);
+
+    for (i = 0; i < nthreads; i++) {
+        pool_stats(&workers[i].pool, pool, sizeof(pool));
+        printf("%s:\tworker %d: cpu %d, %lu accepts, %d connections, pool: %s\n",
+               get_time(), i, workers[i].cpu,
+               __atomic_load_n(&workers[i].accepts, __ATOMIC_RELAXED),
+               __atomic_load_n(&workers[i].curr_conn, __ATOMIC_RELAXED),
+               pool);
+    }
+}
+
+/* --- epoll engine ----------------------------------------------------- */
+
+static void epoll_loop(struct WORKER *w)
+{
+    struct REQUEST      *req;
+    struct epoll_event  events[MAX_EVENTS];
+    int64_t             wait;
+    int                 i, n, idle;
+
+    if (-1 == (w->efd = epoll_create1(EPOLL_CLOEXEC))) {
+        perror("epoll_create1");
+        return;
+    }
+
+    listen_on(w, 1);
+
+    for (; !termsig;) {
+        if (take_sighup()) {
+            print_stats();
+        }
+
+        /* go! -- sleep until the next timeout is due */
+        wait = wheel_next(&w->wheel, mono_msec());
+        n = epoll_wait(w->efd, events, MAX_EVENTS, wait > INT_MAX ? INT_MAX : wait);
+
+        if (-1 == n) {
+            if (EINTR != errno) {
+                perror("epoll_wait");
             }
+
+            continue;
         }
 
-        /* check active connections */
-        for (req = conns, prev = NULL; req != NULL;) {
+        now = time(NULL);
+        w->msec = mono_msec();
+
+        for (i = 0; i < n; i++) {
+            req = events[i].data.ptr;
+
+            /* new connection ? */
+            if (NULL == req) {
+                accept_requests(w);
+                continue;
+            }
+
             /* handle I/O */
             switch (req->state) {
                 case STATE_KEEPALIVE:
                 case STATE_READ_HEADER:
+                    idle = req->state == STATE_KEEPALIVE;
+                    req->state = STATE_READ_HEADER;
 
-                    if (FD_ISSET(req->fd, &rd)) {
-                        req->state = STATE_READ_HEADER;
-                        read_request(req, 0);
-                        req->ping = now;
+                    if (-1 == pool_attach(&w->pool, req)) {
+                        req->state = STATE_CLOSE;
+                        break;
+                    }
+
+                    read_request(req, 0);
+
+                    if (req->state == STATE_READ_HEADER && 0 == req->hdata) {
+                        /* spurious wakeup, don't sit on the buffers, and
+                         * an idle connection stays idle (keepalive_time) */
+                        pool_detach(&w->pool, req);
+
+                        if (idle) {
+                            req->state = STATE_KEEPALIVE;
+                        }
                     }
 
                     break;
@@ -249,163 +654,326 @@ static void *mainloop(void *thread_arg)
                 case STATE_WRITE_BODY:
                 case STATE_WRITE_FILE:
                 case STATE_WRITE_RANGES:
-
-                    if (FD_ISSET(req->fd, &wr)) {
-                        write_request(req);
-                        req->ping = now;
-                    }
-
+                case STATE_WRITE_STREAM:
+                    write_request(req);
                     break;
             }
 
-            /* check timeouts */
-            if (req->state == STATE_KEEPALIVE) {
-                if (now > req->ping + keepalive_time || curr_conn > max_conn * 9 / 10) {
-                    req->state = STATE_CLOSE;
-                }
-            } else if (req->state > 0) {
-                if (now > req->ping + timeout) {
-                    if (req->state == STATE_READ_HEADER) {
-                        mkerror(req, 408, 0);
-                    } else {
-                        req->state = STATE_CLOSE;
-                    }
-                }
-            }
+            handle_request(w, req);
+        }
+
+        wheel_run(&w->wheel, w->msec, expire_request, w);
+    }
 
-            /* header parsing */
-header_parsing:
+    close(w->efd);
+}
 
-            if (req->state == STATE_PARSE_HEADER) {
-                parse_request(req);
+/* --- io_uring engine -------------------------------------------------- */
 
-                if (req->state == STATE_WRITE_HEADER) {
-                    write_request(req);
-                }
-            }
+/*
+ * Instead of waiting for readiness and doing one syscall per step, every
+ * connection keeps exactly one operation queued in the worker's ring:
+ * recv into hreq while reading the header, send for in-memory data and a
+ * splice pair (file -> pipe -> socket) for file bodies.  Connections
+ * without request buffers (new or idle) poll for input first, so the
+ * buffers are only borrowed once there is something to read.  Submissions and
+ * completions of all connections are batched into one io_uring_enter()
+ * per loop iteration.
+ */
 
-            /* handle finished requests */
-            if (req->state == STATE_FINISHED && !req->keep_alive) {
-                req->state = STATE_CLOSE;
-            }
+static void uring_accept(struct WORKER *w, int opcode)
+{
+    struct io_uring_sqe *sqe;
 
-            if (req->state == STATE_FINISHED) {
-                req->auth[0]       = 0;
-                req->if_modified   = NULL;
-                req->if_unmodified = NULL;
-                req->if_range      = NULL;
-                req->range_hdr     = NULL;
-                req->ranges        = 0;
-
-                if (req->r_start) {
-                    free(req->r_start);
-                    req->r_start = NULL;
-                }
+    if (w->accepting || w->curr_conn >= max_conn) {
+        return;
+    }
 
-                if (req->r_end) {
-                    free(req->r_end);
-                    req->r_end   = NULL;
-                }
+    if (NULL == (sqe = uring_get_sqe(&w->ring))) {
+        return;
+    }
 
-                if (req->r_head) {
-                    free(req->r_head);
-                    req->r_head  = NULL;
-                }
+    sqe->opcode = opcode;
+    sqe->fd     = w->lfd;
 
-                if (req->r_hlen) {
-                    free(req->r_hlen);
-                    req->r_hlen  = NULL;
-                }
+    if (IORING_OP_ACCEPT == opcode) {
+        sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+        sqe->user_data    = UD_ACCEPT;
+    } else {
+        sqe->poll32_events = POLLIN;
+        sqe->user_data     = UD_LISTEN;
+    }
 
-                list_free(&req->header);
-                memset(req->mtime,   0, sizeof(req->mtime));
+    w->accepting = 1;
+}
 
-                if (req->bfd != -1) {
-                    close(req->bfd);
-                    req->bfd  = -1;
-                }
+/* queue the operation the current request state waits for */
+static void uring_arm(struct WORKER *w, struct REQUEST *req)
+{
+    struct io_uring_sqe *sqe;
+    char  *buf;
+    off_t off, len;
+    int   events;
+
+    events = state_events(req);
+
+    if (req->inflight) {
+        /* state changed under a pending operation (timeout) */
+        if (req->inflight != events && !req->cancel &&
+            NULL != (sqe = uring_get_sqe(&w->ring))) {
+            sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+            sqe->addr      = (uintptr_t) req;
+            sqe->user_data = UD_IGNORE;
+            req->cancel = 1;
+        }
 
-                req->body      = NULL;
-                req->written   = 0;
-                req->head_only = 0;
-                req->rh        = 0;
-                req->rb        = 0;
+        return;
+    }
 
-                if (req->dir) {
-                    free_dir(req->dir);
-                    req->dir = NULL;
-                }
+    if (0 == events) {
+        return;
+    }
 
-                req->hostname[0] = 0;
-                req->path[0]     = 0;
-                req->query[0]    = 0;
+    len = 0;
 
-                if (req->hdata == req->lreq) {
-                    /* ok, wait for the next one ... */
-                    req->state = STATE_KEEPALIVE;
-                    req->hdata = 0;
-                    req->lreq  = 0;
-                } else {
-                    /* there is a pipelined request in the queue ... */
-                    req->state = STATE_READ_HEADER;
-                    memmove(req->hreq, req->hreq + req->lreq,
-                            req->hdata - req->lreq);
-                    req->hdata -= req->lreq;
-                    req->lreq  =  0;
-                    read_request(req, 1);
-                    goto header_parsing;
-                }
+    if (EPOLLOUT == events && 0 == req->piped && !header_body(req, req->buf->iov) &&
+        0 == (len = next_chunk(req, &buf, &off))) {
+        /* empty file or range */
+        chunk_written(req, 0);
+        handle_request(w, req);
+        return;
+    }
+
+    if (NULL == (sqe = uring_get_sqe(&w->ring))) {
+        req->state = STATE_CLOSE;
+        close_request(w, req);
+        return;
+    }
+
+    sqe->fd        = req->fd;
+    sqe->user_data = (uintptr_t) req;
+
+    if (EPOLLIN == events && NULL == req->buf) {
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        req->op            = OP_POLL;
+    } else if (EPOLLIN == events) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr   = (uintptr_t)(req->hreq + req->hdata);
+        sqe->len    = MAX_HEADER - req->hdata;
+        req->op     = OP_RECV;
+    } else if (EPOLLOUT == events && header_body(req, req->buf->iov)) {
+        /* header and in-memory body at once */
+        memset(&req->buf->msg, 0, sizeof(req->buf->msg));
+        req->buf->msg.msg_iov    = req->buf->iov;
+        req->buf->msg.msg_iovlen = 2;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr   = (uintptr_t) &req->buf->msg;
+        req->op     = OP_SEND;
+    } else if (req->piped) {
+        /* pipe -> socket */
+        sqe->opcode        = IORING_OP_SPLICE;
+        sqe->splice_fd_in  = req->pipefd[0];
+        sqe->splice_off_in = (__u64) -1;
+        sqe->off           = (__u64) -1;
+        sqe->len           = req->piped;
+        sqe->splice_flags  = SPLICE_F_MOVE;
+        req->op            = OP_SPLICE_OUT;
+    } else if (buf) {
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->addr      = (uintptr_t) buf;
+        sqe->len       = len;
+        sqe->msg_flags = chunk_more(req) ? MSG_MORE : 0;
+        req->op        = OP_SEND;
+    } else {
+        /* file -> pipe */
+        if (-1 == req->pipefd[0] && -1 == pipe2(req->pipefd, O_CLOEXEC)) {
+            perror("pipe2");
+            sqe->opcode    = IORING_OP_NOP;
+            sqe->user_data = UD_IGNORE;
+            req->state = STATE_CLOSE;
+            close_request(w, req);
+            return;
+        }
+
+        sqe->opcode        = IORING_OP_SPLICE;
+        sqe->fd            = req->pipefd[1];
+        sqe->splice_fd_in  = req->bfd;
+        sqe->splice_off_in = off;
+        sqe->off           = (__u64) -1;
+        sqe->len           = len < PIPE_CHUNK ? len : PIPE_CHUNK;
+        sqe->splice_flags  = SPLICE_F_MOVE;
+        req->op            = OP_SPLICE_IN;
+    }
+
+    req->inflight = events;
+}
+
+static void uring_complete(struct WORKER *w, struct REQUEST *req, int res)
+{
+    struct io_uring_sqe *sqe;
+    int events = req->inflight;
+
+    req->inflight = 0;
+    req->cancel   = 0;
+
+    if (req->state == STATE_CLOSE) {
+        close_request(w, req);
+        return;
+    }
+
+    if (events != state_events(req) || -ECANCELED == res) {
+        /* cancelled by a timeout, continue with the new state */
+        handle_request(w, req);
+        return;
+    }
+
+    if (-EAGAIN == res && NULL != (sqe = uring_get_sqe(&w->ring))) {
+        /* kernel didn't wait for us, wait for readiness and retry */
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->fd            = req->fd;
+        sqe->poll32_events = (EPOLLIN == events) ? POLLIN : POLLOUT;
+        sqe->user_data     = (uintptr_t) req;
+        req->inflight = events;
+        req->op       = OP_POLL;
+        return;
+    }
+
+    if (res < 0 || (0 == res && OP_POLL != req->op)) {
+        req->state = STATE_CLOSE;
+        close_request(w, req);
+        return;
+    }
+
+    switch (req->op) {
+        case OP_RECV:
+            req->state = STATE_READ_HEADER;
+            req->hdata += res;
+            req->hreq[req->hdata] = 0;
+            scan_request(req);
+            break;
+        case OP_SEND:
+            chunk_written(req, res);
+            break;
+        case OP_SPLICE_IN:
+            req->piped = res;
+            break;
+        case OP_SPLICE_OUT:
+            req->piped -= res;
+            chunk_written(req, res);
+            break;
+        case OP_POLL:
+            /* readable now, recv needs buffers */
+            if (EPOLLIN == events && -1 == pool_attach(&w->pool, req)) {
+                req->state = STATE_CLOSE;
             }
 
-            /* connections to close */
-            if (req->state == STATE_CLOSE) {
-                close(req->fd);
+            break;
+    }
 
-                if (req->bfd != -1) {
-                    close(req->bfd);
-                }
+    handle_request(w, req);
+}
 
-                if (req->dir) {
-                    free_dir(req->dir);
-                }
+static void uring_loop(struct WORKER *w)
+{
+    struct io_uring_cqe *cqe;
+    struct REQUEST      *req;
+    uint64_t            ud;
+    int                 res;
 
-                curr_conn--;
-                printf("%s:\tfd: %03d; current connections: %d\n", get_time(), req->fd, curr_conn);
-                /* unlink from list */
-                tmp = req;
+    uring_accept(w, IORING_OP_ACCEPT);
 
-                if (prev == NULL) {
-                    conns = req->next;
-                    req = conns;
-                } else {
-                    prev->next = req->next;
-                    req = req->next;
-                }
+    for (; !termsig;) {
+        if (take_sighup()) {
+            print_stats();
+        }
 
-                /* free memory  */
-                if (tmp->r_start) {
-                    free(tmp->r_start);
-                }
+        /* go! -- submit everything queued, wait for completions
+         * or until the next timeout is due */
+        if (-1 == uring_submit(&w->ring, 1, wheel_next(&w->wheel, mono_msec()))) {
+            if (EINTR != errno && ETIME != errno && EAGAIN != errno && EBUSY != errno) {
+                perror("io_uring_enter");
+            }
+        }
 
-                if (tmp->r_end) {
-                    free(tmp->r_end);
-                }
+        now = time(NULL);
+        w->msec = mono_msec();
 
-                if (tmp->r_head) {
-                    free(tmp->r_head);
-                }
+        while (NULL != (cqe = uring_peek_cqe(&w->ring))) {
+            ud  = cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(&w->ring);
 
-                if (tmp->r_hlen) {
-                    free(tmp->r_hlen);
-                }
+            switch (ud) {
+                case UD_ACCEPT:
+                    w->accepting = 0;
 
-                list_free(&tmp->header);
-                free(tmp);
-            } else {
-                prev = req;
-                req = req->next;
+                    if (res >= 0) {
+                        if (NULL != (req = new_request(w, res))) {
+                            handle_request(w, req);
+                        }
+
+                        uring_accept(w, IORING_OP_ACCEPT);
+                    } else if (-EAGAIN == res) {
+                        uring_accept(w, IORING_OP_POLL_ADD);
+                    } else {
+                        if (-EINTR != res && -ECONNABORTED != res) {
+                            fprintf(stderr, "accept: %s\n", strerror(-res));
+                        }
+
+                        uring_accept(w, IORING_OP_ACCEPT);
+                    }
+
+                    break;
+                case UD_LISTEN:
+                    w->accepting = 0;
+                    uring_accept(w, IORING_OP_ACCEPT);
+                    break;
+                case UD_IGNORE:
+                    break;
+                default:
+                    uring_complete(w, (struct REQUEST *)(uintptr_t) ud, res);
+                    break;
             }
         }
+
+        wheel_run(&w->wheel, w->msec, expire_request, w);
+    }
+
+    uring_exit(&w->ring);
+}
+
+static void *mainloop(void *thread_arg)
+{
+    struct WORKER       *w = thread_arg;
+
+    if (-1 != w->cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+
+        if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            fprintf(stderr, "worker %d: can't pin to cpu %d\n", w->id, w->cpu);
+        }
+    }
+
+    w->msec = mono_msec();
+    wheel_init(&w->wheel, w->msec);
+
+    if (use_uring) {
+        /* one ring slot per connection, plus accept and timeout, as
+         * long as that doesn't make for a huge ring */
+        if (0 == uring_init(&w->ring, max_conn + 4 < MAX_RING ? max_conn + 4 : MAX_RING)) {
+            w->uring = 1;
+        } else if (0 == w->id) {
+            fprintf(stderr, "io_uring: %s, using epoll\n", strerror(errno));
+        }
+    }
+
+    if (w->uring) {
+        uring_loop(w);
+    } else {
+        epoll_loop(w);
     }
 
     return NULL;
@@ -413,15 +981,80 @@ header_parsing:
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ * Connections per worker unless -n says otherwise: the descriptor limit,
+ * raised as far as we may, shared by the workers once the file cache and
+ * FD_SLACK took theirs.  A connection needs its socket, and two more for
+ * the splice pipe while io_uring sends a file.
+ */
+static int default_conns(void)
+{
+    struct rlimit rl;
+    long fds;
+
+    if (-1 == getrlimit(RLIMIT_NOFILE, &rl)) {
+        return 10;
+    }
+
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+
+        if (-1 == setrlimit(RLIMIT_NOFILE, &rl)) {
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    fds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX ? INT_MAX : rl.rlim_cur;
+    fds = (fds - max_filecache - FD_SLACK) / nthreads / (use_uring ? 3 : 1);
+    return fds < 10 ? 10 : fds > INT_MAX / 2 ? INT_MAX / 2 : fds;
+}
+
+static int listen_socket(struct addrinfo *res, struct sockaddr_storage *ss, int ss_len)
+{
+    int fd, opt = 1;
+
+    if (-1 == (fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol))) {
+        perror("socket");
+        return -1;
+    }
+
+    close_on_exec(fd);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (reuseport && -1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    if (-1 == bind(fd, (struct sockaddr *) ss, ss_len)) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (-1 == listen(fd, 2 * max_conn)) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 int main(int argc, char *argv[])
 {
     struct sigaction         act, old;
     struct addrinfo          ask, *res;
     struct sockaddr_storage  ss;
-    int c, opt, rc, ss_len;
+    sigset_t                 mask;
+    cpu_set_t                cpus;
+    int c, i, cpu, rc, ss_len;
     char host[INET6_ADDRSTRLEN + 1];
     char serv[16];
-    const char options[] = "hd" "p:";
+    const char options[] = "hdrui" "p:t:n:R:m:z:c:M:L:";
     memset(&ask, 0, sizeof(ask));
 
     /* parse options */
@@ -437,11 +1070,56 @@ int main(int argc, char *argv[])
             case 'p':
                 listen_port = optarg;
                 break;
+            case 'r':
+                reuseport = 1;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'n':
+                max_conn = atoi(optarg);
+                break;
+            case 'R':
+                if ((max_ranges = atoi(optarg)) < 1) {
+                    fprintf(stderr, "-R %s: need at least one range\n", optarg);
+                    exit(1);
+                }
+
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'm':
+                max_memfile = atoll(optarg);
+                break;
+            case 'z':
+                gzip_level = atoi(optarg);
+                break;
+            case 'c':
+                init_policy(optarg);
+                break;
+            case 'M':
+                mime_file = optarg;
+                break;
+            case 'L':
+                max_dircache = atoll(optarg);
+                break;
+            case 'i':
+                use_inotify = 0;
+                break;
             default:
                 exit(1);
         }
     }
 
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    if (max_conn < 1) {
+        max_conn = default_conns();
+    }
+
     /* bind to socket */
     memset(&ask, 0, sizeof(ask));
     ask.ai_flags = AI_PASSIVE;
@@ -458,15 +1136,6 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    if (-1 == (slisten = socket(res->ai_family, res->ai_socktype, res->ai_protocol))) {
-        exit(1);
-    }
-
-    if (-1 == slisten) {
-        exit(1);
-    }
-
-    close_on_exec(slisten);
     memcpy(&ss, res->ai_addr, res->ai_addrlen);
     ss_len = res->ai_addrlen;
 
@@ -477,19 +1146,51 @@ int main(int argc, char *argv[])
     }
 
     tcp_port = atoi(serv);
-    opt = 1;
-    setsockopt(slisten, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    fcntl(slisten, F_SETFL, O_NONBLOCK);
 
-    if (-1 == bind(slisten, (struct sockaddr *) &ss, ss_len)) {
+    if (-1 == (slisten = listen_socket(res, &ss, ss_len))) {
         exit(1);
     }
 
-    if (-1 == listen(slisten, 2 * max_conn)) {
-        exit(1);
+    /* setup workers: either all share slisten, or each one gets its
+     * own SO_REUSEPORT socket and cpu so the kernel balances accepts */
+    workers = calloc(nthreads, sizeof(struct WORKER));
+
+    if (reuseport) {
+        sched_getaffinity(0, sizeof(cpus), &cpus);
     }
 
+    for (i = 0, cpu = 0; i < nthreads; i++) {
+        workers[i].id  = i;
+        workers[i].cpu = -1;
+        workers[i].lfd = slisten;
+
+        if (!reuseport) {
+            continue;
+        }
+
+        if (i > 0 && -1 == (workers[i].lfd = listen_socket(res, &ss, ss_len))) {
+            exit(1);
+        }
+
+        /* pick the next cpu we are allowed to run on */
+        for (c = 0; c < CPU_SETSIZE; c++, cpu++) {
+            if (CPU_ISSET(cpu % CPU_SETSIZE, &cpus)) {
+                workers[i].cpu = cpu++ % CPU_SETSIZE;
+                break;
+            }
+        }
+    }
+
+    freeaddrinfo(res);
+
     init_quote();
+    init_mime(mime_file, "application/octet-stream");
+    init_dircache();
+
+    if (use_inotify) {
+        init_watch();
+    }
+
     printf("gx start!\n\n");
 #if defined(linux)
     printf("###############################\n");
@@ -509,18 +1210,29 @@ int main(int argc, char *argv[])
     sigaction(SIGTERM, &act, &old);
     sigaction(SIGINT, &act, &old);
 
-    /* go! */
+    /* go! -- signals are handled by the main thread only */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
     if (nthreads > 1) {
-        int i;
         threads = malloc(sizeof(pthread_t) * nthreads);
 
         for (i = 1; i < nthreads; i++) {
-            pthread_create(threads + i, NULL, mainloop, threads + i);
+            pthread_create(threads + i, NULL, mainloop, workers + i);
             pthread_detach(threads[i]);
         }
     }
 
-    mainloop(NULL);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    mainloop(workers);
+
+    if (reuseport) {
+        print_stats();
+    }
+
     fprintf(stderr, "bye...\n");
     exit(0);
 }
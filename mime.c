@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -9,79 +10,264 @@
 
 #include "httpd.h"
 
+/*
+ * File extension -> mime type.  The types file (mime.types format) is
+ * read at startup, the builtin table below fills in what it lacks or
+ * everything if there is no such file.  All of it goes into an open
+ * addressing hash keyed by the lowercased extension, so a lookup costs
+ * one hash and usually one compare.  The file cache keeps the result
+ * with the entry.
+ */
+
+#define MAX_EXT     32
+#define WHITESPACE  " \t\r\n"
+
 struct MIME {
-    char  ext[8];
-    char  type[64];
+    unsigned int hash;
+    char         *ext;               /* lowercase, NULL for a free slot */
+    char         *type;
+};
+
+static const struct {
+    char *ext;
+    char *type;
+} builtin[] = {
+    { "html",  "text/html" },
+    { "htm",   "text/html" },
+    { "css",   "text/css" },
+    { "txt",   "text/plain" },
+    { "text",  "text/plain" },
+    { "log",   "text/plain" },
+    { "md",    "text/markdown" },
+    { "csv",   "text/csv" },
+    { "ics",   "text/calendar" },
+    { "vtt",   "text/vtt" },
+    { "xml",   "text/xml" },
+    { "c",     "text/x-csrc" },
+    { "h",     "text/x-chdr" },
+    { "sh",    "text/x-sh" },
+    { "py",    "text/x-python" },
+    { "js",    "application/javascript" },
+    { "mjs",   "application/javascript" },
+    { "json",  "application/json" },
+    { "map",   "application/json" },
+    { "wasm",  "application/wasm" },
+    { "pdf",   "application/pdf" },
+    { "rtf",   "application/rtf" },
+    { "epub",  "application/epub+zip" },
+    { "zip",   "application/zip" },
+    { "gz",    "application/gzip" },
+    { "tgz",   "application/gzip" },
+    { "bz2",   "application/x-bzip2" },
+    { "xz",    "application/x-xz" },
+    { "zst",   "application/zstd" },
+    { "tar",   "application/x-tar" },
+    { "7z",    "application/x-7z-compressed" },
+    { "rar",   "application/vnd.rar" },
+    { "iso",   "application/x-iso9660-image" },
+    { "deb",   "application/vnd.debian.binary-package" },
+    { "rpm",   "application/x-rpm" },
+    { "apk",   "application/vnd.android.package-archive" },
+    { "dmg",   "application/x-apple-diskimage" },
+    { "exe",   "application/x-msdownload" },
+    { "png",   "image/png" },
+    { "jpg",   "image/jpeg" },
+    { "jpeg",  "image/jpeg" },
+    { "gif",   "image/gif" },
+    { "webp",  "image/webp" },
+    { "avif",  "image/avif" },
+    { "svg",   "image/svg+xml" },
+    { "ico",   "image/vnd.microsoft.icon" },
+    { "bmp",   "image/bmp" },
+    { "tif",   "image/tiff" },
+    { "tiff",  "image/tiff" },
+    { "woff",  "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf",   "font/ttf" },
+    { "otf",   "font/otf" },
+    { "mp3",   "audio/mpeg" },
+    { "ogg",   "audio/ogg" },
+    { "oga",   "audio/ogg" },
+    { "opus",  "audio/ogg" },
+    { "wav",   "audio/wav" },
+    { "flac",  "audio/flac" },
+    { "m4a",   "audio/mp4" },
+    { "aac",   "audio/aac" },
+    { "mp4",   "video/mp4" },
+    { "m4v",   "video/mp4" },
+    { "webm",  "video/webm" },
+    { "ogv",   "video/ogg" },
+    { "mkv",   "video/x-matroska" },
+    { "mov",   "video/quicktime" },
+    { "avi",   "video/x-msvideo" },
 };
 
 static char         *mime_default;
-static struct MIME  *mime_types;
-static int           mime_count;
+static struct MIME  *mime_table;
+static unsigned int mime_mask;           /* table size - 1 */
+static int          mime_count;
+
+static unsigned int hash_ext(char *ext, int *len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; ext[i]; i++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) ext[i])) * 16777619u;
+    }
+
+    *len = i;
+    return h;
+}
+
+static struct MIME *find_slot(char *ext, unsigned int hash)
+{
+    struct MIME *m;
+    unsigned int i;
 
+    for (i = hash & mime_mask;; i = (i + 1) & mime_mask) {
+        m = &mime_table[i];
+
+        if (NULL == m->ext || (m->hash == hash && 0 == strcasecmp(m->ext, ext))) {
+            return m;
+        }
+    }
+}
+
+static void grow(void)
+{
+    struct MIME *old = mime_table, *m;
+    unsigned int i, size = old ? (mime_mask + 1) * 2 : 256;
+
+    mime_table = calloc(size, sizeof(struct MIME));
+    mime_mask  = size - 1;
+
+    for (i = 0; old && i < size / 2; i++) {
+        if (NULL != old[i].ext) {
+            m  = find_slot(old[i].ext, old[i].hash);
+            *m = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/* the first definition of an extension wins */
 static void add_mime(char *ext, char *type)
 {
-    if (0 == (mime_count % 64)) {
-        mime_types = realloc(mime_types, (mime_count + 64) * sizeof(struct MIME));
+    struct MIME *m;
+    unsigned int hash;
+    int len, i;
+
+    if (NULL == mime_table || 2 * (mime_count + 1) > mime_mask + 1) {
+        grow();
+    }
+
+    hash = hash_ext(ext, &len);
+
+    if (len >= MAX_EXT || NULL != (m = find_slot(ext, hash))->ext) {
+        return;
+    }
+
+    m->hash = hash;
+    m->ext  = strdup(ext);
+    m->type = type;
+
+    for (i = 0; i < len; i++) {
+        m->ext[i] = tolower((unsigned char) m->ext[i]);
     }
 
-    strcpy(mime_types[mime_count].ext, ext);
-    strcpy(mime_types[mime_count].type, type);
     mime_count++;
 }
 
 char *get_mime(char *file)
 {
-    int i;
+    struct MIME *m;
+    unsigned int hash;
     char *ext;
+    int  len;
+
     ext = strrchr(file, '.');
 
-    if (NULL == ext) {
+    if (NULL == ext || NULL != strchr(ext, '/') || NULL == mime_table) {
         return mime_default;
     }
 
-    ext++;
+    hash = hash_ext(++ext, &len);
 
-    for (i = 0; i < mime_count; i++) {
-        if (0 == strcasecmp(ext, mime_types[i].ext)) {
-            return mime_types[i].type;
-        }
+    if (len >= MAX_EXT || NULL == (m = find_slot(ext, hash))->ext) {
+        return mime_default;
     }
 
-    return mime_default;
+    return m->type;
 }
 
 void init_mime(char *file, char *def)
 {
     FILE *fp;
-    char line[128], type[64], ext[8];
-    int  len, off;
+    char line[1024], type[64], ext[MAX_EXT], *stype, *p;
+    int  len, i, c;
     mime_default = strdup(def);
 
     if (NULL == (fp = fopen(file, "r"))) {
-        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
-        return;
-    }
+        fprintf(stderr, "open %s: %s, using builtin mime types\n", file, strerror(errno));
+    } else {
+        while (NULL != fgets(line, sizeof(line), fp)) {
+            len = strlen(line);
 
-    while (NULL != fgets(line, 127, fp)) {
-        if (line[0] == '#') {
-            continue;
-        }
+            if (len > 0 && line[len - 1] != '\n' && !feof(fp)) {
+                /* too long, skip it instead of taking its tail for a line */
+                while (EOF != (c = fgetc(fp)) && c != '\n')
+                    ;
 
-        if (1 != sscanf(line, "%63s%n", type, &len)) {
-            continue;
-        }
+                continue;
+            }
+
+            if (line[0] == '#') {
+                continue;
+            }
 
-        off = len;
+            /* tokens which don't fit are skipped, not cut to size: a
+             * truncated type drops the line, a truncated extension itself */
+            p   = line + strspn(line, WHITESPACE);
+            len = strcspn(p, WHITESPACE);
 
-        for (;;) {
-            if (1 != sscanf(line + off, "%7s%n", ext, &len)) {
-                break;
+            if (0 == len || len >= sizeof(type)) {
+                continue;
             }
 
-            off += len;
-            add_mime(ext, type);
+            memcpy(type, p, len);
+            type[len] = 0;
+            stype = NULL;
+
+            for (p += len;; p += len) {
+                p  += strspn(p, WHITESPACE);
+                len = strcspn(p, WHITESPACE);
+
+                if (0 == len) {
+                    break;
+                }
+
+                if (len >= MAX_EXT) {
+                    continue;
+                }
+
+                memcpy(ext, p, len);
+                ext[len] = 0;
+
+                if (NULL == stype) {
+                    /* shared by all extensions of the line */
+                    stype = strdup(type);
+                }
+
+                add_mime(ext, stype);
+            }
         }
+
+        fclose(fp);
     }
 
-    fclose(fp);
+    for (i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+        add_mime(builtin[i].ext, builtin[i].type);
+    }
 }
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+/*
+ * Caching policies (-c file).  Each line names a path prefix (starting
+ * with '/'), a mime type ("image/png") or a major type ("image/"), the
+ * max-age in seconds and optionally more Cache-Control directives:
+ *
+ *     /static/v        31536000  public, immutable
+ *     text/html        60
+ *     image/           86400
+ *
+ * The first matching line wins.  Lookups happen once per file cache or
+ * listing cache entry, not per request.
+ */
+
+static struct POLICY *policies;
+static int           npolicies;
+
+static void add_policy(char *key, int maxage, char *extra)
+{
+    struct POLICY *p;
+    char buf[320];
+    int  len = strlen(key);
+
+    if (0 == (npolicies % 16)) {
+        policies = realloc(policies, (npolicies + 16) * sizeof(struct POLICY));
+    }
+
+    p = &policies[npolicies++];
+    p->path   = key[0] == '/';
+    p->prefix = p->path || key[len - 1] == '/';
+    p->match   = strdup(key);
+    p->len     = len;
+    p->maxage  = maxage;
+    p->lheader = snprintf(buf, sizeof(buf), "Cache-Control: max-age=%d%s%s\r\n",
+                          maxage, *extra ? ", " : "", extra);
+    p->header  = strdup(buf);
+}
+
+struct POLICY *get_policy(char *path, char *mime)
+{
+    struct POLICY *p;
+    char *key;
+    int  i;
+
+    for (i = 0; i < npolicies; i++) {
+        p   = &policies[i];
+        key = p->path ? path : mime;
+
+        if (NULL == key || 0 != strncmp(key, p->match, p->len)) {
+            continue;
+        }
+
+        if (p->prefix || key[p->len] == '\0') {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+void init_policy(char *file)
+{
+    FILE *fp;
+    char line[256], key[128], *extra;
+    int  maxage, len;
+
+    if (NULL == (fp = fopen(file, "r"))) {
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        if (2 != sscanf(line, "%127s %d%n", key, &maxage, &len) || maxage < 0) {
+            continue;
+        }
+
+        /* the rest of the line, trimmed */
+        for (extra = line + len; *extra == ' ' || *extra == '\t'; extra++)
+            ;
+
+        extra[strcspn(extra, "\r\n")] = 0;
+        add_policy(key, maxage, extra);
+    }
+
+    fclose(fp);
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+#define POOL_SLAB    16     /* REQUESTs per slab */
+#define POOL_RANGES  8      /* range buffers above this are not kept */
+#define POOL_RHEAD   (POOL_RANGES * (BR_HEADER + 32))
+
+/*
+ * A REQUEST lives exactly as long as its connection but only holds the
+ * small per-connection state; the big header, path and response buffers
+ * (struct REQBUF) are attached when a request starts and detached again
+ * when the connection goes idle, so an idle keep-alive connection costs
+ * a few hundred bytes.  Each worker keeps both kinds of objects on free
+ * lists instead of returning them to malloc.
+ */
+
+static int pool_grow(struct POOL *pool)
+{
+    struct REQUEST *slab;
+    int i;
+
+    if (NULL == (slab = calloc(POOL_SLAB, sizeof(struct REQUEST)))) {
+        return -1;
+    }
+
+    for (i = 0; i < POOL_SLAB; i++) {
+        slab[i].next = pool->free;
+        pool->free = slab + i;
+    }
+
+    pool->slabs++;
+    pool->objects += POOL_SLAB;
+    return 0;
+}
+
+struct REQUEST *pool_get(struct POOL *pool)
+{
+    struct REQUEST *req;
+
+    if (NULL == pool->free && -1 == pool_grow(pool)) {
+        return NULL;
+    }
+
+    req = pool->free;
+    pool->free = req->next;
+
+    memset(req, 0, sizeof(*req));
+
+    pool->gets++;
+    pool->used++;
+
+    if (pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+
+    return req;
+}
+
+void pool_put(struct POOL *pool, struct REQUEST *req)
+{
+    pool_detach(pool, req);
+    req->next = pool->free;
+    pool->free = req;
+    pool->used--;
+}
+
+/* point the range aliases of req at the buffers of req->buf */
+static void set_ranges(struct REQUEST *req)
+{
+    struct REQBUF *b = req->buf;
+
+    if (NULL == b || NULL == b->r_start) {
+        req->r_start = NULL;
+        req->r_end   = NULL;
+        req->r_hoff  = NULL;
+        req->r_head  = NULL;
+        return;
+    }
+
+    req->r_start = b->r_start;
+    req->r_end   = req->r_start + b->r_cap;
+    req->r_hoff  = (int *)(req->r_end + b->r_cap);
+    req->r_head  = (char *)(req->r_hoff + b->r_cap + 2);
+}
+
+/* borrow request buffers, a no-op if req has some already */
+int pool_attach(struct POOL *pool, struct REQUEST *req)
+{
+    struct REQBUF *b;
+
+    if (NULL != req->buf) {
+        return 0;
+    }
+
+    if (NULL != pool->bufs) {
+        b = pool->bufs;
+        pool->bufs = b->next;
+    } else {
+        if (NULL == (b = malloc(sizeof(*b)))) {
+            return -1;
+        }
+
+        b->r_cap   = 0;
+        b->r_hcap  = 0;
+        b->r_start = NULL;
+        pool->nbufs++;
+    }
+
+    /* the big buffers are always written before they are read */
+    b->next        = NULL;
+    b->hostname[0] = 0;
+    b->auth[0]     = 0;
+    b->mtime[0]    = 0;
+    b->etag[0]     = 0;
+    b->hreq[0]     = 0;
+    b->path[0]     = 0;
+    b->query[0]    = 0;
+
+    req->buf      = b;
+    req->hreq     = b->hreq;
+    req->type     = NULL;
+    req->hostname = b->hostname;
+    req->auth     = b->auth;
+    req->uri      = NULL;
+    req->path     = b->path;
+    req->query    = b->query;
+    req->hres     = b->hres;
+    req->mtime    = b->mtime;
+    req->etag     = b->etag;
+    req->bst      = &b->bst;
+    set_ranges(req);
+
+    pool->bufs_used++;
+
+    if (pool->bufs_used > pool->bufs_peak) {
+        pool->bufs_peak = pool->bufs_used;
+    }
+
+    return 0;
+}
+
+/* hand the buffers of an idle (or dead) connection back to the pool */
+void pool_detach(struct POOL *pool, struct REQUEST *req)
+{
+    struct REQBUF *b = req->buf;
+
+    if (NULL == b) {
+        return;
+    }
+
+    if (b->r_cap > POOL_RANGES || b->r_hcap > POOL_RHEAD) {
+        free(b->r_start);
+        b->r_start = NULL;
+        b->r_cap   = 0;
+        b->r_hcap  = 0;
+    }
+
+    b->next = pool->bufs;
+    pool->bufs = b;
+    pool->bufs_used--;
+
+    req->buf      = NULL;
+    req->hreq     = NULL;
+    req->type     = NULL;
+    req->hostname = NULL;
+    req->auth     = NULL;
+    req->uri      = NULL;
+    req->path     = NULL;
+    req->query    = NULL;
+    req->hres     = NULL;
+    req->mtime    = NULL;
+    req->etag     = NULL;
+    req->bst      = NULL;
+    set_ranges(req);
+}
+
+/*
+ * Make sure the range buffers of req have room for >ranges< ranges and
+ * >hsize< bytes of multipart subheaders.  All of them live in one
+ * allocation which stays with the request buffers.
+ */
+int pool_ranges(struct REQUEST *req, int ranges, int hsize)
+{
+    struct REQBUF *b = req->buf;
+    char *buf;
+    int  cap, hcap;
+
+    if (ranges <= b->r_cap && hsize <= b->r_hcap) {
+        return 0;
+    }
+
+    cap  = ranges < POOL_RANGES ? POOL_RANGES : ranges;
+    hcap = hsize  < POOL_RHEAD  ? POOL_RHEAD  : hsize;
+    buf  = malloc(cap * (2 * sizeof(off_t)) + (cap + 2) * sizeof(int) + hcap);
+
+    if (NULL == buf) {
+        return -1;
+    }
+
+    free(b->r_start);
+    b->r_start = (off_t *) buf;
+    b->r_cap   = cap;
+    b->r_hcap  = hcap;
+    set_ranges(req);
+    return 0;
+}
+
+void pool_stats(struct POOL *pool, char *buf, int size)
+{
+    snprintf(buf, size, "%lu slabs, %lu objects, %lu used (peak %lu), %lu gets, "
+             "%lu buffers, %lu attached (peak %lu)",
+             __atomic_load_n(&pool->slabs, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->objects, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->used, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->peak, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->gets, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->nbufs, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->bufs_used, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->bufs_peak, __ATOMIC_RELAXED));
+}
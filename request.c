@@ -6,6 +6,9 @@
 #include <errno.h>
 #include <ctype.h>
 #include <netinet/in.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "httpd.h"
 
@@ -14,7 +17,6 @@
 void read_request(struct REQUEST *req, int pipelined)
 {
     int rc;
-    char *h;
 restart:
     rc = read(req->fd, req->hreq + req->hdata, MAX_HEADER - req->hdata);
 
@@ -42,41 +44,395 @@ restart:
             req->hreq[req->hdata] = 0;
     }
 
+    scan_request(req);
+}
+
+/* first '\n' in [p, end), NULL if there is none */
+static inline char *find_lf(char *p, char *end)
+{
+#if defined(__AVX2__)
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 32; p += 32) {
+        unsigned int m = _mm256_movemask_epi8(
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) p), lf32));
+
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+    }
+
+#endif
+#if defined(__SSE2__)
+    const __m128i lf16 = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        unsigned int m = _mm_movemask_epi8(
+                             _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p), lf16));
+
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+    }
+
+#endif
+    return memchr(p, '\n', end - p);
+}
+
+/* case-insensitive compare of a (name, len) slice against a literal */
+#define IS_TOKEN(name, len, lit) \
+    ((len) == sizeof(lit) - 1 && 0 == strncasecmp(name, lit, sizeof(lit) - 1))
+
+/* is the qvalue at h zero, "0", "0.", "0.000"? */
+static int zero_q(char *h)
+{
+    if (*h++ != '0') {
+        return 0;
+    }
+
+    if (*h == '.') {
+        for (h++; *h == '0'; h++)
+            ;
+    }
+
+    return !isdigit((unsigned char) *h);
+}
+
+/* ENC_* mask of the codings an Accept-Encoding header allows */
+static int parse_encodings(char *h)
+{
+    char *name;
+    int  mask = 0, len, zero;
+
+    for (;;) {
+        while (*h == ' ' || *h == '\t' || *h == ',') {
+            h++;
+        }
+
+        for (name = h; isalnum((unsigned char) *h) || *h == '*' || *h == '-'; h++)
+            ;
+
+        if (0 == (len = h - name)) {
+            break;
+        }
+
+        zero = 0;
+
+        /* parameters, only q matters */
+        for (; *h && *h != ','; h++) {
+            if (*h == ';') {
+                while (h[1] == ' ' || h[1] == '\t') {
+                    h++;
+                }
+
+                if ((h[1] == 'q' || h[1] == 'Q') && h[2] == '=') {
+                    zero = zero_q(h + 3);
+                }
+            }
+        }
+
+        if (!zero) {
+            if (IS_TOKEN(name, len, "gzip")) {
+                mask |= ENC_GZIP;
+            } else if (IS_TOKEN(name, len, "br")) {
+                mask |= ENC_BR;
+            } else if (IS_TOKEN(name, len, "*")) {
+                mask |= ENC_GZIP | ENC_BR;
+            }
+        }
+    }
+
+    return mask;
+}
+
+/*
+ * The listing format an Accept header asks for: json or ndjson if it
+ * names one of them and not text/html, so browsers keep getting html.
+ */
+static int parse_accept(char *h)
+{
+    char *name;
+    int  format = LIST_HTML, html = 0, len, zero;
+
+    for (;;) {
+        while (*h == ' ' || *h == '\t' || *h == ',') {
+            h++;
+        }
+
+        for (name = h; *h && *h != ',' && *h != ';' && *h != ' ' && *h != '\t'; h++)
+            ;
+
+        if (0 == (len = h - name)) {
+            break;
+        }
+
+        zero = 0;
+
+        for (; *h && *h != ','; h++) {
+            if (*h == ';') {
+                while (h[1] == ' ' || h[1] == '\t') {
+                    h++;
+                }
+
+                if ((h[1] == 'q' || h[1] == 'Q') && h[2] == '=') {
+                    zero = zero_q(h + 3);
+                }
+            }
+        }
+
+        if (zero) {
+            continue;
+        }
+
+        if (IS_TOKEN(name, len, "text/html")) {
+            html = 1;
+        } else if (IS_TOKEN(name, len, "application/json") && LIST_HTML == format) {
+            format = LIST_JSON;
+        } else if (IS_TOKEN(name, len, "application/x-ndjson") ||
+                   IS_TOKEN(name, len, "application/ndjson")) {
+            format = LIST_NDJSON;
+        }
+    }
+
+    return html ? LIST_HTML : format;
+}
+
+/* copy the [a-zA-Z0-9.-] prefix of src, returns its length */
+static int copy_host(char *dst, char *src)
+{
+    int i;
+
+    for (i = 0; i < MAX_HOST && (isalnum((unsigned char) src[i]) ||
+                                 src[i] == '.' || src[i] == '-'); i++) {
+        dst[i] = src[i];
+    }
+
+    dst[i] = 0;
+    return i;
+}
+
+/* "http://host[:port]/path": pick the hostname, leave uri at the path */
+static int parse_absolute(struct REQUEST *req, char *target)
+{
+    char *p;
+    int  len;
+
+    if (0 != strncasecmp(target, "http://", 7) ||
+        0 == (len = copy_host(req->hostname, target + 7))) {
+        return -1;
+    }
+
+    p = target + 7 + len;
+
+    if (*p == ':') {
+        for (p++; isdigit((unsigned char) *p); p++)
+            ;
+    }
+
+    req->uri = p;
+    return 0;
+}
+
+/* "METHOD target HTTP/x.y" */
+static int parse_request_line(struct REQUEST *req, char *line, int len)
+{
+    char *end = line + len, *target, *version, *sp;
+
+    if (NULL == (sp = memchr(line, ' ', len)) || sp - line > MAX_MISC) {
+        return -1;
+    }
+
+    *sp = 0;
+    req->type = line;
+    target = sp + 1;
+
+    if (NULL == (sp = memchr(target, ' ', end - target)) || sp == target ||
+        sp - target > MAX_PATH) {
+        return -1;
+    }
+
+    *sp = 0;
+    version = sp + 1;
+
+    if (end - version < 8 || 0 != strncmp(version, "HTTP/", 5) ||
+        !isdigit((unsigned char) version[5]) || version[6] != '.' ||
+        !isdigit((unsigned char) version[7])) {
+        return -1;
+    }
+
+    req->major = version[5] - '0';
+    req->minor = version[7] - '0';
+    req->keep_alive = req->minor;
+
+    if (target[0] == '/') {
+        req->uri = target;
+        return 0;
+    }
+
+    return parse_absolute(req, target);
+}
+
+#define HKEY(len, c)   ((len) << 8 | (c))
+
+/*
+ * "Name: value", cut into slices in place and recorded in buf->hdr.  The
+ * headers we act on are picked by their length and first letter, one
+ * strncasecmp() confirms the name, and land in their req->* slots.
+ */
+static void parse_header_line(struct REQUEST *req, char *line, int len)
+{
+    struct HEADER *h;
+    char *value, *end = line + len;
+    int  nlen;
+
+    if (NULL == (value = memchr(line, ':', len))) {
+        /* not a header line, ignore it */
+        return;
+    }
+
+    nlen = value - line;
+
+    for (value++; value < end && (*value == ' ' || *value == '\t'); value++)
+        ;
+
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    *end = 0;
+
+    if (req->nhdr < MAX_HEADERS) {
+        h = &req->buf->hdr[req->nhdr++];
+        h->name   = line - req->hreq;
+        h->lname  = nlen;
+        h->value  = value - req->hreq;
+        h->lvalue = end - value;
+    }
+
+#define NAME(lit)   (0 == strncasecmp(line, lit, sizeof(lit) - 1))
+
+    switch (HKEY(nlen, line[0] | 0x20)) {
+        case HKEY(4, 'h'):
+            if (NAME("Host")) {
+                copy_host(req->hostname, value);
+            }
+
+            break;
+        case HKEY(5, 'r'):
+            if (NAME("Range") && 0 == strncmp(value, "bytes=", 6)) {
+                /* parsing must be done after fstat, we need the file size
+                   for the boundary checks */
+                req->range_hdr = value + 6;
+            }
+
+            break;
+        case HKEY(6, 'a'):
+            if (NAME("Accept")) {
+                req->list_format = parse_accept(value);
+            }
+
+            break;
+        case HKEY(8, 'i'):
+            if (NAME("If-Range")) {
+                req->if_range = value;
+            }
+
+            break;
+        case HKEY(10, 'c'):
+            if (NAME("Connection")) {
+                req->keep_alive = (0 == strncasecmp(value, "Keep-Alive", 10));
+            }
+
+            break;
+        case HKEY(13, 'i'):
+            if (NAME("If-None-Match")) {
+                req->if_none_match = value;
+            }
+
+            break;
+        case HKEY(15, 'a'):
+            if (NAME("Accept-Encoding")) {
+                req->accept_enc = parse_encodings(value);
+            }
+
+            break;
+        case HKEY(17, 'i'):
+            if (NAME("If-Modified-Since")) {
+                req->if_modified = value;
+            }
+
+            break;
+        case HKEY(19, 'i'):
+            if (NAME("If-Unmodified-Since")) {
+                req->if_unmodified = value;
+            }
+
+            break;
+    }
+
+#undef NAME
+}
+
+/*
+ * Check whether the data in hreq holds a complete request header.  The
+ * scan is incremental: it resumes at req->hscan, so every byte is looked
+ * at once no matter how the header trickles in.  Each complete line is
+ * parsed right away, cut in place into slices which point into hreq;
+ * req->hline is where the current (incomplete) line starts.
+ */
+void scan_request(struct REQUEST *req)
+{
+    char *p, *line, *end = req->hreq + req->hdata;
+    int  len, first;
+
     /* check if this looks like a http request after
        the first few bytes... */
     if (req->hdata < 5) {
         return;
     }
 
-    if (strncmp(req->hreq, "GET ", 4)  != 0  && strncmp(req->hreq, "PUT ", 4)  != 0  && strncmp(req->hreq, "HEAD ", 5) != 0  && strncmp(req->hreq, "POST ", 5) != 0) {
+    if (0 == req->hscan &&
+        strncmp(req->hreq, "GET ", 4)  != 0  && strncmp(req->hreq, "PUT ", 4)  != 0  && strncmp(req->hreq, "HEAD ", 5) != 0  && strncmp(req->hreq, "POST ", 5) != 0) {
         mkerror(req, 400, 0);
         return;
     }
 
-    /* header complete ?? */
-    if (NULL != (h = strstr(req->hreq, "\r\n\r\n")) || NULL != (h = strstr(req->hreq, "\n\n"))) {
-        if (*h == '\r') {
-            h += 4;
-            *(h - 2) = 0;
-        } else {
-            h += 2;
-            *(h - 1) = 0;
+    for (p = req->hreq + req->hscan; NULL != (p = find_lf(p, end)); p++) {
+        line  = req->hreq + req->hline;
+        len   = p - line;
+        first = 0 == req->hline;
+        req->hline = p + 1 - req->hreq;
+
+        if (len > 0 && p[-1] == '\r') {
+            len--;
         }
 
-        req->lreq  = h - req->hreq;
-        req->state = STATE_PARSE_HEADER;
-        return;
+        line[len] = 0;
+
+        if (0 == len) {
+            /* header complete */
+            req->lreq  = req->hline;
+            req->hscan = req->hline;
+            req->state = STATE_PARSE_HEADER;
+            return;
+        }
+
+        if (!first) {
+            parse_header_line(req, line, len);
+        } else if (0 != parse_request_line(req, line, len)) {
+            mkerror(req, 400, 0);
+            return;
+        }
     }
 
+    req->hscan = req->hdata;
+
     if (req->hdata == MAX_HEADER) {
         mkerror(req, 400, 0);
         return;
     }
-
-    return;
 }
 
-
 static off_t parse_off_t(char *str, int *pos)
 {
     off_t value = 0;
@@ -90,44 +446,38 @@ static off_t parse_off_t(char *str, int *pos)
     return value;
 }
 
+/*
+ * Parse the Range header into req->r_start/r_end (end exclusive).  The
+ * set is normalized: ranges beyond the end of the file are clipped or
+ * dropped, the rest is sorted and overlapping or adjacent ones are
+ * merged.  More than max_ranges ranges are ignored altogether (the full
+ * file is sent), which bounds the memory a request can ask for.
+ */
 static int
 parse_ranges(struct REQUEST *req)
 {
-    char *h, *line = req->range_hdr;
-    int  i, off;
+    char  *h, *line = req->range_hdr;
+    off_t size = req->bst->st_size, start, end;
+    int   i, j, n, off;
 
-    for (h = line, req->ranges = 1; *h != '\n' && *h != '\0'; h++)
+    for (h = line, n = 1; *h != '\n' && *h != '\0'; h++)
         if (*h == ',') {
-            req->ranges++;
-        }
-
-    req->r_start = malloc(req->ranges * sizeof(off_t));
-    req->r_end   = malloc(req->ranges * sizeof(off_t));
-    req->r_head  = malloc((req->ranges + 1) * BR_HEADER);
-    req->r_hlen  = malloc((req->ranges + 1) * sizeof(int));
-
-    if (NULL == req->r_start || NULL == req->r_end ||
-        NULL == req->r_head  || NULL == req->r_hlen) {
-        if (req->r_start) {
-            free(req->r_start);
-        }
-
-        if (req->r_end) {
-            free(req->r_end);
+            n++;
         }
 
-        if (req->r_head) {
-            free(req->r_head);
-        }
-
-        if (req->r_hlen) {
-            free(req->r_hlen);
-        }
+    if (n > max_ranges) {
+        return 0;
+    }
 
+    if (-1 == pool_ranges(req, n, (n + 1) * (BR_HEADER + (req->mime ? strlen(req->mime) : 32)))) {
         return 500;
     }
 
-    for (i = 0, off = 0; i < req->ranges; i++) {
+    for (i = 0, off = 0; i < n; i++) {
+        while (line[off] == ' ') {
+            off++;
+        }
+
         if (line[off] == '-') {
             off++;
 
@@ -135,14 +485,18 @@ parse_ranges(struct REQUEST *req)
                 goto parse_error;
             }
 
-            req->r_start[i] = req->bst.st_size - parse_off_t(line, &off);
-            req->r_end[i]   = req->bst.st_size;
+            start = size - parse_off_t(line, &off);
+            end   = size;
+
+            if (start < 0) {
+                start = 0;
+            }
         } else {
             if (!isdigit(line[off])) {
                 goto parse_error;
             }
 
-            req->r_start[i] = parse_off_t(line, &off);
+            start = parse_off_t(line, &off);
 
             if (line[off] != '-') {
                 goto parse_error;
@@ -151,21 +505,60 @@ parse_ranges(struct REQUEST *req)
             off++;
 
             if (isdigit(line[off])) {
-                req->r_end[i] = parse_off_t(line, &off) + 1;
+                end = parse_off_t(line, &off) + 1;
+
+                if (start >= end) {
+                    goto parse_error;
+                }
             } else {
-                req->r_end[i] = req->bst.st_size;
+                end = size;
             }
         }
 
+        while (line[off] == ' ') {
+            off++;
+        }
+
         off++; /* skip "," */
 
-        /* ranges ok? */
-        if (req->r_start[i] > req->r_end[i] ||
-            req->r_end[i]   > req->bst.st_size) {
-            goto parse_error;
+        /* clip to the file, drop what lies behind its end */
+        if (end > size) {
+            end = size;
         }
+
+        if (start >= end) {
+            continue;
+        }
+
+        /* insert sorted by start, n is small */
+        for (j = req->ranges; j > 0 && req->r_start[j - 1] > start; j--) {
+            req->r_start[j] = req->r_start[j - 1];
+            req->r_end[j]   = req->r_end[j - 1];
+        }
+
+        req->r_start[j] = start;
+        req->r_end[j]   = end;
+        req->ranges++;
     }
 
+    if (0 == req->ranges) {
+        return 416;
+    }
+
+    /* merge overlapping and adjacent ranges */
+    for (i = 0, j = 1; j < req->ranges; j++) {
+        if (req->r_start[j] <= req->r_end[i]) {
+            if (req->r_end[j] > req->r_end[i]) {
+                req->r_end[i] = req->r_end[j];
+            }
+        } else {
+            i++;
+            req->r_start[i] = req->r_start[j];
+            req->r_end[i]   = req->r_end[j];
+        }
+    }
+
+    req->ranges = i + 1;
     return 0;
 parse_error:
     req->ranges = 0;
@@ -214,6 +607,68 @@ static void unquote(unsigned char *path, unsigned char *qs, unsigned char *src)
     *dst = 0;
 }
 
+/* Content-Type of a listing by LIST_* */
+static char *list_types[LIST_FORMATS] = {
+    "text/html", "application/json", "application/x-ndjson"
+};
+
+/* does the query value [val, end) equal word? */
+static int is_value(char *val, char *end, char *word)
+{
+    return (int) strlen(word) == end - val && 0 == strncmp(val, word, end - val);
+}
+
+/* ?offset=&limit=&sort=name|size|mtime&order=asc|desc of a listing, and
+ * ?format=html|json|ndjson, which overrides Accept; anything else is
+ * ignored */
+static void parse_query(struct REQUEST *req)
+{
+    char *key, *val, *end;
+
+    for (key = req->query; *key; key = *end ? end + 1 : end) {
+        end = key + strcspn(key, "&");
+
+        if (NULL == (val = memchr(key, '=', end - key))) {
+            continue;
+        }
+
+        val++;
+
+        if (0 == strncmp(key, "format=", 7)) {
+            /* the same view, just differently dressed */
+            if (is_value(val, end, "json")) {
+                req->list_format = LIST_JSON;
+            } else if (is_value(val, end, "ndjson")) {
+                req->list_format = LIST_NDJSON;
+            } else {
+                req->list_format = LIST_HTML;
+            }
+
+            continue;
+        }
+
+        if (0 == strncmp(key, "offset=", 7)) {
+            req->list_offset = atoi(val) > 0 ? atoi(val) : 0;
+        } else if (0 == strncmp(key, "limit=", 6)) {
+            req->list_limit = atoi(val) > 0 ? atoi(val) : 0;
+        } else if (0 == strncmp(key, "sort=", 5)) {
+            if (is_value(val, end, "size")) {
+                req->list_sort = SORT_SIZE;
+            } else if (is_value(val, end, "mtime")) {
+                req->list_sort = SORT_MTIME;
+            } else {
+                req->list_sort = SORT_NAME;
+            }
+        } else if (0 == strncmp(key, "order=", 6)) {
+            req->list_desc = is_value(val, end, "desc");
+        } else {
+            continue;
+        }
+
+        req->list_view = 1;
+    }
+}
+
 /* delete unneeded path elements */
 static void fixpath(char *path)
 {
@@ -295,46 +750,175 @@ static int sanity_checks(struct REQUEST *req)
     return 0;
 }
 
-void parse_request(struct REQUEST *req)
+/*
+ * Swap req->file for its precompressed sidecar if the client takes that
+ * coding, brotli first.  req->mime must be set from the original.
+ */
+static void negotiate(struct REQUEST *req, char *filename)
 {
-    char filename[MAX_PATH + 1], proto[MAX_MISC + 1], *h;
-    int  port, rc, len;
-
-    /* parse request. Hehe, scanf is powerfull :-) */
-    if (4 != sscanf(req->hreq,
-                    "%" S(MAX_MISC) "[A-Z] "
-                    "%" S(MAX_PATH) "[^ \t\r\n] HTTP/%d.%d",
-                    req->type, filename, &(req->major), &(req->minor))) {
-        mkerror(req, 400, 0);
+    struct FILECACHE *side;
+    int len = strlen(filename);
+
+    if (0 == req->file->variants) {
         return;
     }
 
-    if (filename[0] == '/') {
-        strncpy(req->uri, filename, sizeof(req->uri) - 1);
+    req->vary = 1;
+
+    if (len + 4 > MAX_PATH) {
+        return;
+    }
+
+    if (req->accept_enc & req->file->variants & ENC_BR) {
+        strcpy(filename + len, ".br");
+        req->encoding = "br";
+    } else if (req->accept_enc & req->file->variants & ENC_GZIP) {
+        strcpy(filename + len, ".gz");
+        req->encoding = "gzip";
     } else {
-        port = 0;
-        *proto = 0;
-
-        if (4 != sscanf(filename,
-                        "%" S(MAX_MISC) "[a-zA-Z]://"
-                        "%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d"
-                        "%" S(MAX_PATH) "[^ \t\r\n]",
-                        proto, req->hostname, &port, req->uri) &&
-            3 != sscanf(filename,
-                        "%" S(MAX_MISC) "[a-zA-Z]://"
-                        "%" S(MAX_HOST) "[a-zA-Z0-9.-]"
-                        "%" S(MAX_PATH) "[^ \t\r\n]",
-                        proto, req->hostname, req->uri)) {
-            mkerror(req, 400, 0);
-            return;
+        return;
+    }
+
+    side = get_file(filename);
+    filename[len] = 0;
+
+    if (NULL == side) {
+        /* gone meanwhile, fall back to identity */
+        req->encoding = NULL;
+        return;
+    }
+
+    free_file(req->file);
+    req->file = side;
+}
+
+/*
+ * Does the If-None-Match list name etag?  Weak comparison: a W/ prefix
+ * is ignored, "*" matches anything.
+ */
+static int match_etag(char *list, char *etag)
+{
+    char *end;
+    int  len = strlen(etag);
+
+    while (*list) {
+        if (*list == ' ' || *list == ',') {
+            list++;
+            continue;
         }
 
-        if (*proto != 0 && 0 != strcasecmp(proto, "http")) {
-            mkerror(req, 400, 0);
-            return;
+        if (*list == '*') {
+            return 1;
+        }
+
+        if (0 == strncmp(list, "W/", 2)) {
+            list += 2;
+        }
+
+        if (*list != '"' || NULL == (end = strchr(list + 1, '"'))) {
+            return 0;
+        }
+
+        if (end - list + 1 == len && 0 == strncmp(list, etag, len)) {
+            return 1;
+        }
+
+        list = end + 1;
+    }
+
+    return 0;
+}
+
+/* tag for a variant of the representation, "foo" -> "foo-gz" */
+static void etag_variant(char *etag, char *suffix)
+{
+    int len = strlen(etag);
+
+    if (len > 0 && len + strlen(suffix) < MAX_ETAG) {
+        sprintf(etag + len - 1, "%s\"", suffix);
+    }
+}
+
+/*
+ * The ETag the full path would answer with, for a file which isn't cached
+ * and from stat() data only: the tag of the sidecar negotiate() would
+ * pick, else the file's own, with "-gz" if the file may be compressed on
+ * the fly and that is the one the client has.  Sets req->encoding (and
+ * req->bst, for a sidecar) to match.  -1 if the sidecar went away
+ * meanwhile.
+ */
+static int probe_etag(struct REQUEST *req, char *filename, int variants)
+{
+    struct stat st;
+    char path[MAX_PATH + 8], gz[MAX_ETAG];
+    int  len = strlen(filename), enc = variants & req->accept_enc;
+
+    mketag(req->etag, req->bst);
+    req->encoding = NULL;
+
+    if (0 != enc && len + 4 <= MAX_PATH) {
+        enc = (enc & ENC_BR) ? ENC_BR : ENC_GZIP;
+        memcpy(path, filename, len);
+        strcpy(path + len, ENC_BR == enc ? ".br" : ".gz");
+
+        if (0 != stat(path, &st) || !S_ISREG(st.st_mode)) {
+            return -1;
+        }
+
+        /* the full path answers with the sidecar's data */
+        *req->bst = st;
+        mketag(req->etag, req->bst);
+        req->encoding = ENC_BR == enc ? "br" : "gzip";
+    } else if ((req->accept_enc & ENC_GZIP) && gzip_type(req->mime) &&
+               req->bst->st_size > 0 && req->bst->st_size <= max_memfile &&
+               req->bst->st_size <= max_memcache) {
+        strcpy(gz, req->etag);
+        etag_variant(gz, "-gz");
+
+        if (match_etag(req->if_none_match, gz)) {
+            strcpy(req->etag, gz);
+            req->encoding = "gzip";
         }
     }
 
+    return 0;
+}
+
+/* If-None-Match, or If-Modified-Since when there is none */
+static int not_modified(struct REQUEST *req)
+{
+    if (NULL != req->if_none_match) {
+        return match_etag(req->if_none_match, req->etag);
+    }
+
+    return NULL != req->if_modified && 0 == strcmp(req->if_modified, req->mtime);
+}
+
+/* does If-Range still name what we would send?  Entity tags must match
+ * strongly, anything else is taken as a date */
+static int range_current(struct REQUEST *req)
+{
+    if (NULL == req->if_range) {
+        return 1;
+    }
+
+    if (req->if_range[0] == '"') {
+        return 0 == strcmp(req->if_range, req->etag);
+    }
+
+    if (0 == strncmp(req->if_range, "W/", 2)) {
+        return 0;
+    }
+
+    return 0 == strcmp(req->if_range, req->mtime);
+}
+
+void parse_request(struct REQUEST *req)
+{
+    char filename[MAX_PATH + 1], *h, *gz;
+    struct tm tm;
+    int  rc, len, variants;
+
     unquote((unsigned char *) req->path,
             (unsigned char *) req->query,
             (unsigned char *) req->uri);
@@ -350,41 +934,6 @@ void parse_request(struct REQUEST *req)
         req->head_only = 1;
     }
 
-    /* parse header lines */
-    req->keep_alive = req->minor;
-
-    for (h = req->hreq; h - req->hreq < req->lreq;) {
-        h = strchr(h, '\n');
-
-        if (NULL == h) {
-            break;
-        }
-
-        h++;
-        h[-2] = 0;
-        h[-1] = 0;
-        list_add(&req->header, h, 0);
-
-        if (0 == strncasecmp(h, "Connection: ", 12)) {
-            req->keep_alive = (0 == strncasecmp(h + 12, "Keep-Alive", 10));
-        } else if (0 == strncasecmp(h, "Host: ", 6)) {
-            if (2 != sscanf(h + 6, "%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d",
-                            req->hostname, &port))
-                sscanf(h + 6, "%" S(MAX_HOST) "[a-zA-Z0-9.-]",
-                       req->hostname);
-        } else if (0 == strncasecmp(h, "If-Modified-Since: ", 19)) {
-            req->if_modified = h + 19;
-        } else if (0 == strncasecmp(h, "If-Unmodified-Since: ", 21)) {
-            req->if_unmodified = h + 21;
-        } else if (0 == strncasecmp(h, "If-Range: ", 10)) {
-            req->if_range = h + 10;
-        } else if (0 == strncasecmp(h, "Range: bytes=", 13)) {
-            /* parsing must be done after fstat, we need the file size
-               for the boundary checks */
-            req->range_hdr = h + 13;
-        }
-    }
-
     /* checks */
     if (0 != sanity_checks(req)) {
         return;
@@ -400,9 +949,14 @@ void parse_request(struct REQUEST *req)
 
     if (*h == '/') {
         /* looks like the client asks for a directory */
-        if (-1 == stat(filename, &(req->bst))) {
+        req->mime = "text/html";
+        parse_query(req);
+
+        if (NULL == (req->dir = get_dir(req, filename))) {
             if (errno == EACCES) {
                 mkerror(req, 403, 1);
+            } else if (errno == ENOMEM) {
+                mkerror(req, 500, 0);
             } else {
                 mkerror(req, 404, 1);
             }
@@ -410,19 +964,45 @@ void parse_request(struct REQUEST *req)
             return;
         }
 
-        strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
-        req->mime = "text/html";
-        req->dir = get_dir(req, filename);
-
-        if (NULL == req->body) {
+        if (NULL == req->dir->files) {
             /* We arrive here if opendir failed, probably due to -EPERM
-             * It does exist (see the stat() call above) */
+             * It does exist (get_dir() could stat() it) */
             mkerror(req, 403, 1);
             return;
-        } else if (NULL != req->if_modified && 0 == strcmp(req->if_modified, req->mtime)) {
+        }
+
+        strcpy(req->etag, req->dir->etag);
+        req->policy = req->dir->policy;
+        req->mime   = list_types[req->list_format];
+        req->vary   = gzip_type(req->mime);
+
+        if (LIST_HTML != req->list_format) {
+            etag_variant(req->etag, LIST_JSON == req->list_format ? "-json" : "-ndjson");
+        }
+
+        if (req->list_view || NULL == (req->body = get_dir_body(req, &len))) {
+            /* a big one or a view of it, streamed as it is rendered */
+            req->body  = NULL;
+            req->lbody = 0;
+            req->vary  = 0;
+        } else {
+            req->lbody = len;
+
+            if (req->vary && (req->accept_enc & ENC_GZIP) &&
+                NULL != (gz = get_dir_gz(req->dir, req->list_format, &len))) {
+                req->body     = gz;
+                req->lbody    = len;
+                req->encoding = "gzip";
+                etag_variant(req->etag, "-gz");
+            }
+        }
+
+        if (not_modified(req)) {
             /* 304 not modified */
             mkheader(req, 304);
             req->head_only = 1;
+        } else if (NULL == req->body && -1 == open_stream(req)) {
+            mkerror(req, 500, 0);
         } else {
             /* 200 OK */
             mkheader(req, 200);
@@ -431,56 +1011,86 @@ void parse_request(struct REQUEST *req)
         return;
     }
 
-    /* it is /probably/ a regular file */
-    if (-1 == (req->bfd = open(filename, O_RDONLY))) {
-        if (errno == EACCES) {
-            mkerror(req, 403, 1);
-        } else {
-            mkerror(req, 404, 1);
-        }
-
-        return;
-    }
-
-    fstat(req->bfd, &(req->bst));
-
-    if (req->range_hdr)
-        if (0 != (rc = parse_ranges(req))) {
-            mkerror(req, rc, 1);
+    /* revalidating a file which isn't cached: stat() tells whether the
+     * client's copy is current, no need to open the file */
+    if (NULL != req->if_none_match && NULL == req->if_unmodified &&
+        0 == probe_file(filename, req->bst, &variants)) {
+        req->mime = get_mime(filename);
+
+        if (0 == probe_etag(req, filename, variants) &&
+            match_etag(req->if_none_match, req->etag)) {
+            req->policy = get_policy(req->path, req->mime);
+            req->vary   = 0 != variants ||
+                          (gzip_type(req->mime) && req->bst->st_size > 0 &&
+                           req->bst->st_size <= max_memfile);
+            strftime(req->mtime, sizeof(req->buf->mtime), RFC1123,
+                     gmtime_r(&req->bst->st_mtime, &tm));
+            mkheader(req, 304);
+            req->head_only = 1;
             return;
         }
 
-    if (!S_ISREG(req->bst.st_mode)) {
-        /* /not/ a regular file */
-        close(req->bfd);
-        req->bfd = -1;
+        req->encoding = NULL;
+    }
 
-        if (S_ISDIR(req->bst.st_mode)) {
+    /* it is /probably/ a regular file */
+    if (NULL == (req->file = get_file(filename))) {
+        if (errno == EISDIR) {
             /* oops: a directory without trailing slash */
             strcat(req->path, "/");
             mkredirect(req);
-        } else {
+        } else if (errno == EACCES) {
             /* anything else is'nt allowed here */
             mkerror(req, 403, 1);
+        } else if (errno == ENOMEM) {
+            mkerror(req, 500, 1);
+        } else {
+            mkerror(req, 404, 1);
         }
 
         return;
     }
 
     /* it is /really/ a regular file */
-    req->mime = get_mime(filename);
-    strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
+    req->mime   = req->file->mime;
+    req->policy = req->file->policy;
+    negotiate(req, filename);
+    req->bfd  = req->file->fd;
+    *req->bst = req->file->st;
+    strcpy(req->mtime, req->file->mtime);
+    strcpy(req->etag, req->file->etag);
+
+    /* If-Range mismatch -> send the whole file */
+    if (req->range_hdr && range_current(req))
+        if (0 != (rc = parse_ranges(req))) {
+            req->ranges = 0;
+            mkerror(req, rc, 1);
+            return;
+        }
 
-    if (NULL != req->if_range  &&  0 != strcmp(req->if_range, req->mtime))
-        /* mtime mismatch -> no ranges */
-    {
-        req->ranges = 0;
+    if (req->file->data && NULL == req->encoding && gzip_type(req->mime)) {
+        /* may be compressed on the fly */
+        req->vary = 1;
+    }
+
+    if (0 == req->ranges && req->file->data) {
+        /* small file, send it from memory */
+        req->body  = req->file->data;
+        req->lbody = req->bst->st_size;
+
+        if (req->vary && NULL == req->encoding && (req->accept_enc & ENC_GZIP) &&
+            NULL != (gz = get_file_gz(req->file, &len))) {
+            req->body     = gz;
+            req->lbody    = len;
+            req->encoding = "gzip";
+            etag_variant(req->etag, "-gz");
+        }
     }
 
     if (NULL != req->if_unmodified && 0 != strcmp(req->if_unmodified, req->mtime)) {
         /* 412 precondition failed */
         mkerror(req, 412, 1);
-    } else if (NULL != req->if_modified && 0 == strcmp(req->if_modified, req->mtime)) {
+    } else if (not_modified(req)) {
         /* 304 not modified */
         mkheader(req, 304);
         req->head_only = 1;
@@ -15,7 +15,7 @@
 #include "httpd.h"
 
 #define wrap_xsendfile(req,off,bytes)  xsendfile(req->fd,req->bfd,off,bytes)
-#define wrap_write(req,buf,bytes)      write(req->fd,buf,bytes);
+#define wrap_write(req,buf,bytes)      send(req->fd,buf,bytes,chunk_more(req) ? MSG_MORE : 0)
 
 static inline size_t off_to_size(off_t off_bytes)
 {
@@ -66,23 +66,141 @@ http[] = {
     { 404, "404 Not Found",                "File or directory not found\n" },
     { 408, "408 Request Timeout",          "Request Timeout\n" },
     { 412, "412 Precondition failed.",     "Precondition failed\n" },
+    { 416, "416 Range Not Satisfiable",    "Range not satisfiable\n" },
     { 500, "500 Internal Server Error",    "Sorry folks\n" },
     { 501, "501 Not Implemented",          "Sorry folks\n" },
     {   0, NULL,                        NULL }
 };
 
-#define RESPONSE_START          \
-    "HTTP/1.1 %s\r\n"       \
-    "Server: %s\r\n"        \
-    "Connection: %s\r\n"        \
-    "Accept-Ranges: bytes\r\n"
+#define BOUNDARY_PREFIX     "XXX_CUT_HERE_"
+#define BOUNDARY_SUFFIX     "_XXX"
 
-#define BOUNDARY            \
-    "XXX_CUT_HERE_%ld_XXX"
+/* --- header building: fragments are memcpy'ed, no printf ------------- */
+
+#define PUT(p, lit)  (memcpy(p, lit, sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+static inline char *put_str(char *p, const char *str)
+{
+    size_t len = strlen(str);
+
+    memcpy(p, str, len);
+    return p + len;
+}
+
+static char *put_int(char *p, int64_t value)
+{
+    char     tmp[24], *t = tmp + sizeof(tmp);
+    uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+    do {
+        *--t = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (value < 0) {
+        *--t = '-';
+    }
+
+    memcpy(p, t, tmp + sizeof(tmp) - t);
+    return p + (tmp + sizeof(tmp) - t);
+}
+
+static char *put_hex(char *p, uint64_t v)
+{
+    char tmp[16], *t = tmp + sizeof(tmp);
+
+    do {
+        *--t = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+
+    memcpy(p, t, tmp + sizeof(tmp) - t);
+    return p + (tmp + sizeof(tmp) - t);
+}
+
+static inline char *put_mime(char *p, char *mime)
+{
+    return put_str(p, mime ? mime : "application/octet-stream");
+}
+
+/* status line and the lines every response has */
+static char *put_start(struct REQUEST *req, char *p, char *status)
+{
+    p = PUT(p, "HTTP/1.1 ");
+    p = put_str(p, status);
+    p = PUT(p, "\r\nServer: ");
+    p = put_str(p, server_name);
+
+    if (req->keep_alive) {
+        p = PUT(p, "\r\nConnection: Keep-Alive\r\n");
+    } else {
+        p = PUT(p, "\r\nConnection: Close\r\n");
+    }
+
+    return PUT(p, "Accept-Ranges: bytes\r\n");
+}
+
+static char *put_boundary(char *p)
+{
+    p = PUT(p, BOUNDARY_PREFIX);
+    p = put_int(p, now);
+    return PUT(p, BOUNDARY_SUFFIX);
+}
+
+/* finish the header with the Date line */
+static void put_end(struct REQUEST *req, char *p)
+{
+    p += date_header(p);
+    req->lres  = p - req->hres;
+    req->state = STATE_WRITE_HEADER;
+}
+
+/*
+ * Strong entity tag of a file: inode, size and mtime down to the
+ * nanosecond.  buf needs MAX_ETAG bytes, returns the length.
+ */
+int mketag(char *buf, struct stat *st)
+{
+    char *p = buf;
+
+    *p++ = '"';
+    p = put_hex(p, st->st_ino);
+    *p++ = '-';
+    p = put_hex(p, st->st_size);
+    *p++ = '-';
+    p = put_hex(p, st->st_mtim.tv_sec);
+    *p++ = '.';
+    p = put_hex(p, st->st_mtim.tv_nsec);
+    *p++ = '"';
+    *p = 0;
+    return p - buf;
+}
+
+/*
+ * Content-Type, Content-Length, Last-Modified and ETag of a complete
+ * file.  The file cache builds this once per entry, mkheader() copies it.
+ * buf needs room for MAX_TEMPLATE plus the length of the mime type.
+ */
+int mktemplate(char *buf, char *mime, off_t size, char *mtime, char *etag)
+{
+    char *p = buf;
+
+    p = PUT(p, "Content-Type: ");
+    p = put_mime(p, mime);
+    p = PUT(p, "\r\nContent-Length: ");
+    p = put_int(p, size);
+    p = PUT(p, "\r\nLast-Modified: ");
+    p = put_str(p, mtime);
+    p = PUT(p, "\r\nETag: ");
+    p = put_str(p, etag);
+    p = PUT(p, "\r\n");
+    return p - buf;
+}
 
 void mkerror(struct REQUEST *req, int status, int ka)
 {
-    int i;
+    char *p;
+    int  i;
 
     for (i = 0; http[i].status != 0; i++)
         if (http[i].status == status) {
@@ -97,61 +215,75 @@ void mkerror(struct REQUEST *req, int status, int ka)
         req->keep_alive = 0;
     }
 
-    req->lres = sprintf(req->hres,
-                        RESPONSE_START
-                        "Content-Type: text/plain\r\n"
-                        "Content-Length: %" PRId64 "\r\n",
-                        http[i].head, server_name,
-                        req->keep_alive ? "Keep-Alive" : "Close",
-                        (int64_t)req->lbody);
-
-    if (401 == status)
-        req->lres += sprintf(req->hres + req->lres,
-                             "WWW-Authenticate: Basic realm=\"gx\"\r\n");
-
-    req->lres += strftime(req->hres + req->lres, 80,
-                          "Date: " RFC1123 "\r\n\r\n",
-                          gmtime(&now));
-    req->state = STATE_WRITE_HEADER;
+    p = put_start(req, req->hres, http[i].head);
+    p = PUT(p, "Content-Type: text/plain\r\nContent-Length: ");
+    p = put_int(p, req->lbody);
+    p = PUT(p, "\r\n");
+
+    if (401 == status) {
+        p = PUT(p, "WWW-Authenticate: Basic realm=\"gx\"\r\n");
+    }
+
+    if (416 == status) {
+        p = PUT(p, "Content-Range: bytes */");
+        p = put_int(p, req->bst->st_size);
+        p = PUT(p, "\r\n");
+    }
+
+    put_end(req, p);
 }
 
 void mkredirect(struct REQUEST *req)
 {
+    char *p;
+
     req->status = 302;
     req->body   = req->path;
     req->lbody  = strlen(req->body);
-    req->lres = sprintf(req->hres,
-                        RESPONSE_START
-                        "Location: http://%s:%d%s\r\n"
-                        "Content-Type: text/plain\r\n"
-                        "Content-Length: %" PRId64 "\r\n",
-                        "302 Redirect", server_name,
-                        req->keep_alive ? "Keep-Alive" : "Close",
-                        req->hostname, tcp_port,
-                        quote((unsigned char *) req->path, 9999),
-                        (int64_t)req->lbody);
-    req->lres += strftime(req->hres + req->lres, 80,
-                          "Date: " RFC1123 "\r\n\r\n",
-                          gmtime(&now));
-    req->state = STATE_WRITE_HEADER;
+
+    p = put_start(req, req->hres, "302 Redirect");
+    p = PUT(p, "Location: http://");
+    p = put_str(p, req->hostname);
+    p = PUT(p, ":");
+    p = put_int(p, tcp_port);
+    p = put_str(p, quote((unsigned char *) req->path, 9999));
+    p = PUT(p, "\r\nContent-Type: text/plain\r\nContent-Length: ");
+    p = put_int(p, req->lbody);
+    p = PUT(p, "\r\n");
+    put_end(req, p);
 }
 
+/* subheader of part i (the final boundary for i == ranges), packed right
+ * behind the one of part i-1 */
 static int mkmulti(struct REQUEST *req, int i)
 {
-    req->r_hlen[i] = sprintf(req->r_head + i * BR_HEADER,
-                             "\r\n--" BOUNDARY "\r\n"
-                             "Content-type: %s\r\n"
-                             "Content-range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n"
-                             "\r\n",
-                             now, req->mime,
-                             (int64_t)req->r_start[i],
-                             (int64_t)req->r_end[i] - 1,
-                             (int64_t)req->bst.st_size);
-    return req->r_hlen[i];
+    char *p = req->r_head + req->r_hoff[i];
+
+    p = PUT(p, "\r\n--");
+    p = put_boundary(p);
+
+    if (i == req->ranges) {
+        p = PUT(p, "--\r\n");
+    } else {
+        p = PUT(p, "\r\nContent-type: ");
+        p = put_mime(p, req->mime);
+        p = PUT(p, "\r\nContent-range: bytes ");
+        p = put_int(p, req->r_start[i]);
+        p = PUT(p, "-");
+        p = put_int(p, req->r_end[i] - 1);
+        p = PUT(p, "/");
+        p = put_int(p, req->bst->st_size);
+        p = PUT(p, "\r\n\r\n");
+    }
+
+    req->r_hoff[i + 1] = p - req->r_head;
+    return req->r_hoff[i + 1] - req->r_hoff[i];
 }
 
 void mkheader(struct REQUEST *req, int status)
 {
+    struct FILECACHE *f = req->file;
+    char   *p;
     int    i;
     off_t  len;
 
@@ -161,257 +293,330 @@ void mkheader(struct REQUEST *req, int status)
         }
 
     req->status = status;
-    req->lres = sprintf(req->hres,
-                        RESPONSE_START,
-                        http[i].head, server_name,
-                        req->keep_alive ? "Keep-Alive" : "Close");
-
-    if (req->ranges == 0) {
-        req->lres += sprintf(req->hres + req->lres,
-                             "Content-Type: %s\r\n"
-                             "Content-Length: %" PRId64 "\r\n",
-                             req->mime,
-                             (int64_t)(req->body ? req->lbody : req->bst.st_size));
-    } else if (req->ranges == 1) {
-        req->lres += sprintf(req->hres + req->lres,
-                             "Content-Type: %s\r\n"
-                             "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n"
-                             "Content-Length: %" PRId64 "\r\n",
-                             req->mime,
-                             (int64_t)req->r_start[0],
-                             (int64_t)req->r_end[0] - 1,
-                             (int64_t)req->bst.st_size,
-                             (int64_t)(req->r_end[0] - req->r_start[0]));
+    p = put_start(req, req->hres, http[i].head);
+
+    if (req->ranges == 0 && NULL != f && req->mime == f->mime &&
+        (NULL == req->body || req->body == f->data)) {
+        /* the complete file as it is: use the precomputed lines */
+        memcpy(p, f->tmpl, f->ltmpl);
+        p += f->ltmpl;
     } else {
-        for (i = 0, len = 0; i < req->ranges; i++) {
+        if (req->stream || (req->dir && NULL == req->body)) {
+            /* streamed listing, length unknown (see next_stream()) */
+            p = PUT(p, "Content-Type: ");
+            p = put_mime(p, req->mime);
+
+            if (req->chunked) {
+                p = PUT(p, "\r\nTransfer-Encoding: chunked");
+            }
+        } else if (req->ranges == 0) {
+            p = PUT(p, "Content-Type: ");
+            p = put_mime(p, req->mime);
+            p = PUT(p, "\r\nContent-Length: ");
+            p = put_int(p, req->body ? req->lbody : req->bst->st_size);
+        } else if (req->ranges == 1) {
+            p = PUT(p, "Content-Type: ");
+            p = put_mime(p, req->mime);
+            p = PUT(p, "\r\nContent-Range: bytes ");
+            p = put_int(p, req->r_start[0]);
+            p = PUT(p, "-");
+            p = put_int(p, req->r_end[0] - 1);
+            p = PUT(p, "/");
+            p = put_int(p, req->bst->st_size);
+            p = PUT(p, "\r\nContent-Length: ");
+            p = put_int(p, req->r_end[0] - req->r_start[0]);
+        } else {
+            req->r_hoff[0] = 0;
+
+            for (i = 0, len = 0; i < req->ranges; i++) {
+                len += mkmulti(req, i);
+                len += req->r_end[i] - req->r_start[i];
+            }
+
             len += mkmulti(req, i);
-            len += req->r_end[i] - req->r_start[i];
+            p = PUT(p, "Content-Type: multipart/byteranges; boundary=");
+            p = put_boundary(p);
+            p = PUT(p, "\r\nContent-Length: ");
+            p = put_int(p, len);
+        }
+
+        p = PUT(p, "\r\n");
+
+        if (req->mtime[0] != '\0') {
+            p = PUT(p, "Last-Modified: ");
+            p = put_str(p, req->mtime);
+            p = PUT(p, "\r\n");
         }
 
-        req->r_hlen[i] = sprintf(req->r_head + i * BR_HEADER,
-                                 "\r\n--" BOUNDARY "--\r\n",
-                                 now);
-        len += req->r_hlen[i];
-        req->lres += sprintf(req->hres + req->lres,
-                             "Content-Type: multipart/byteranges;"
-                             " boundary=" BOUNDARY "\r\n"
-                             "Content-Length: %" PRId64 "\r\n",
-                             now, (int64_t)len);
+        if (req->etag[0] != '\0') {
+            p = PUT(p, "ETag: ");
+            p = put_str(p, req->etag);
+            p = PUT(p, "\r\n");
+        }
     }
 
-    if (req->mtime[0] != '\0') {
-        req->lres += sprintf(req->hres + req->lres,
-                             "Last-Modified: %s\r\n",
-                             req->mtime);
+    if (req->encoding) {
+        p = PUT(p, "Content-Encoding: ");
+        p = put_str(p, req->encoding);
+        p = PUT(p, "\r\n");
     }
 
-    req->lres += strftime(req->hres + req->lres, 80,
-                          "Date: " RFC1123 "\r\n\r\n",
-                          gmtime(&now));
-    req->state = STATE_WRITE_HEADER;
+    if (req->dir) {
+        /* listings come as html or json, see parse_accept() */
+        if (req->vary) {
+            p = PUT(p, "Vary: Accept, Accept-Encoding\r\n");
+        } else {
+            p = PUT(p, "Vary: Accept\r\n");
+        }
+    } else if (req->vary) {
+        p = PUT(p, "Vary: Accept-Encoding\r\n");
+    }
+
+    if (req->policy) {
+        memcpy(p, req->policy->header, req->policy->lheader);
+        p += req->policy->lheader;
+        p += expires_header(p, req->policy->maxage);
+    }
+
+    put_end(req, p);
 }
 
-void write_request(struct REQUEST *req)
+/*
+ * Describe the next piece of the response for the current write state:
+ * either memory at *buf, or req->bfd from *off on (*buf == NULL).
+ * Returns its length, -1 if there is nothing to write in this state.
+ */
+off_t next_chunk(struct REQUEST *req, char **buf, off_t *off)
 {
-    int rc;
+    *buf = NULL;
+    *off = req->written;
+
+    switch (req->state) {
+        case STATE_WRITE_HEADER:
+            *buf = req->hres + req->written;
+            return req->lres - req->written;
+        case STATE_WRITE_BODY:
+            *buf = req->body + req->written;
+            return req->lbody - req->written;
+        case STATE_WRITE_FILE:
+            return req->bst->st_size - req->written;
+        case STATE_WRITE_STREAM:
+            return next_stream(req, buf);
+        case STATE_WRITE_RANGES:
+
+            if (-1 != req->rh) {
+                /* subheader */
+                *buf = req->r_head + req->r_hoff[req->rh] + req->written;
+                return req->r_hoff[req->rh + 1] - req->r_hoff[req->rh] - req->written;
+            }
+
+            /* body */
+            return req->r_end[req->rb] - req->written;
+    }
 
-    for (;;) {
-        switch (req->state) {
-            case STATE_WRITE_HEADER:
-                rc = wrap_write(req, req->hres + req->written,
-                                req->lres - req->written);
-
-                switch (rc) {
-                    case -1:
-
-                        if (errno == EAGAIN) {
-                            return;
-                        }
-
-                        if (errno == EINTR) {
-                            continue;
-                        }
-
-                        /* fall through */
-                    case 0:
-                        req->state = STATE_CLOSE;
-                        return;
-                    default:
-                        req->written += rc;
-                        req->bc += rc;
-
-                        if (req->written != req->lres) {
-                            return;
-                        }
-                }
+    return -1;
+}
+
+/*
+ * Header and in-memory body can go out with a single vectored write.
+ * Fills iov and returns 2 if so, 0 otherwise.
+ */
+int header_body(struct REQUEST *req, struct iovec *iov)
+{
+    if (req->state != STATE_WRITE_HEADER || req->head_only || NULL == req->body) {
+        return 0;
+    }
 
-                req->written = 0;
+    iov[0].iov_base = req->hres + req->written;
+    iov[0].iov_len  = req->lres - req->written;
+    iov[1].iov_base = req->body;
+    iov[1].iov_len  = req->lbody;
+    return 2;
+}
 
-                if (req->head_only) {
-                    req->state = STATE_FINISHED;
+/*
+ * Is the current chunk in memory and followed by file data (or the next
+ * piece of a streamed listing)?  It is sent with MSG_MORE then, so it
+ * shares a segment with the first bytes of the sendfile/splice instead of
+ * going out as a packet on its own.
+ */
+int chunk_more(struct REQUEST *req)
+{
+    switch (req->state) {
+        case STATE_WRITE_HEADER:
+
+            if (req->head_only || req->body) {
+                return 0;
+            }
+
+            return req->stream || req->ranges > 0 || req->bst->st_size > 0;
+        case STATE_WRITE_STREAM:
+            return stream_more(req);
+        case STATE_WRITE_RANGES:
+            /* subheaders, except for the final boundary */
+            return -1 != req->rh && req->rh < req->ranges;
+    }
+
+    return 0;
+}
+
+/* account for bytes sent from next_chunk(), move on once it is done */
+void chunk_written(struct REQUEST *req, off_t bytes)
+{
+    off_t rest;
+
+    if (req->state == STATE_WRITE_HEADER && req->written + bytes > req->lres) {
+        /* header_body() write which made it into the body */
+        rest = req->written + bytes - req->lres;
+        chunk_written(req, bytes - rest);
+        chunk_written(req, rest);
+        return;
+    }
+
+    req->written += bytes;
+    req->bc += bytes;
+
+    switch (req->state) {
+        case STATE_WRITE_HEADER:
+
+            if (req->written != req->lres) {
+                return;
+            }
+
+            req->written = 0;
+
+            if (req->head_only) {
+                req->state = STATE_FINISHED;
+            } else if (req->body) {
+                req->state = STATE_WRITE_BODY;
+            } else if (req->stream) {
+                req->state = STATE_WRITE_STREAM;
+            } else if (req->ranges == 1) {
+                req->state = STATE_WRITE_RANGES;
+                req->rh = -1;
+                req->rb = 0;
+                req->written = req->r_start[0];
+            } else if (req->ranges > 1) {
+                req->state = STATE_WRITE_RANGES;
+                req->rh = 0;
+                req->rb = -1;
+            } else {
+                req->state = STATE_WRITE_FILE;
+            }
+
+            return;
+        case STATE_WRITE_BODY:
+
+            if (req->written == req->lbody) {
+                req->state = STATE_FINISHED;
+            }
+
+            return;
+        case STATE_WRITE_FILE:
+
+            if (req->written == req->bst->st_size) {
+                req->state = STATE_FINISHED;
+            }
+
+            return;
+        case STATE_WRITE_STREAM:
+
+            if (stream_done(req)) {
+                req->state = STATE_FINISHED;
+            }
+
+            return;
+        case STATE_WRITE_RANGES:
+
+            if (-1 != req->rh) {
+                if (req->written != req->r_hoff[req->rh + 1] - req->r_hoff[req->rh]) {
                     return;
-                } else if (req->body) {
-                    req->state = STATE_WRITE_BODY;
-                } else if (req->ranges == 1) {
-                    req->state = STATE_WRITE_RANGES;
-                    req->rh = -1;
-                    req->rb = 0;
-                    req->written = req->r_start[0];
-                } else if (req->ranges > 1) {
-                    req->state = STATE_WRITE_RANGES;
-                    req->rh = 0;
-                    req->rb = -1;
-                } else {
-                    req->state = STATE_WRITE_FILE;
                 }
 
-                break;
-            case STATE_WRITE_BODY:
-                rc = wrap_write(req, req->body + req->written,
-                                req->lbody - req->written);
-
-                switch (rc) {
-                    case -1:
-
-                        if (errno == EAGAIN) {
-                            return;
-                        }
-
-                        if (errno == EINTR) {
-                            continue;
-                        }
-
-                        /* fall through */
-                    case 0:
-                        req->state = STATE_CLOSE;
-                        return;
-                    default:
-                        req->written += rc;
-                        req->bc += rc;
-
-                        if (req->written != req->lbody) {
-                            return;
-                        }
+                if (req->rh == req->ranges) {
+                    /* done -- no more ranges */
+                    req->state = STATE_FINISHED;
+                    return;
                 }
 
-                req->state = STATE_FINISHED;
+                /* prepare for body writeout */
+                req->rb      = req->rh;
+                req->rh      = -1;
+                req->written = req->r_start[req->rb];
                 return;
-            case STATE_WRITE_FILE:
-                rc = wrap_xsendfile(req, req->written,
-                                    req->bst.st_size - req->written);
-
-                switch (rc) {
-                    case -1:
-
-                        if (errno == EAGAIN) {
-                            return;
-                        }
-
-                        if (errno == EINTR) {
-                            continue;
-                        }
-
-                        /* fall through */
-                    case 0:
-                        req->state = STATE_CLOSE;
-                        return;
-                    default:
-                        req->written += rc;
-                        req->bc += rc;
-
-                        if (req->written != req->bst.st_size) {
-                            return;
-                        }
-                }
+            }
 
-                req->state = STATE_FINISHED;
+            if (req->written != req->r_end[req->rb]) {
                 return;
-            case STATE_WRITE_RANGES:
-
-                if (-1 != req->rh) {
-                    /* write header */
-                    rc = wrap_write(req,
-                                    req->r_head + req->rh * BR_HEADER + req->written,
-                                    req->r_hlen[req->rh] - req->written);
-
-                    switch (rc) {
-                        case -1:
-
-                            if (errno == EAGAIN) {
-                                return;
-                            }
-
-                            if (errno == EINTR) {
-                                continue;
-                            }
-
-                            /* fall through */
-                        case 0:
-                            req->state = STATE_CLOSE;
-                            return;
-                        default:
-                            req->written += rc;
-                            req->bc += rc;
-
-                            if (req->written != req->r_hlen[req->rh]) {
-                                return;
-                            }
-                    }
-
-                    if (req->rh == req->ranges) {
-                        /* done -- no more ranges */
-                        req->state = STATE_FINISHED;
-                        return;
-                    }
-
-                    /* prepare for body writeout */
-                    req->rb      = req->rh;
-                    req->rh      = -1;
-                    req->written = req->r_start[req->rb];
+            }
+
+            /* prepare for next subheader writeout */
+            req->rh      = req->rb + 1;
+            req->rb      = -1;
+            req->written = 0;
+
+            if (req->ranges == 1) {
+                /* single range only */
+                req->state = STATE_FINISHED;
+            }
+
+            return;
+    }
+}
+
+void write_request(struct REQUEST *req)
+{
+    struct iovec iov[2];
+    char    *buf;
+    off_t   off, len;
+    ssize_t rc;
+
+    for (;;) {
+        if (header_body(req, iov)) {
+            len = iov[0].iov_len + iov[1].iov_len;
+            rc  = writev(req->fd, iov, 2);
+            goto written;
+        }
+
+        if (0 > (len = next_chunk(req, &buf, &off))) {
+            return;
+        }
+
+        if (0 == len) {
+            /* empty file or range */
+            chunk_written(req, 0);
+            continue;
+        }
+
+        if (buf) {
+            rc = wrap_write(req, buf, len);
+        } else {
+            rc = wrap_xsendfile(req, off, len);
+        }
+
+written:
+        switch (rc) {
+            case -1:
+
+                if (errno == EAGAIN) {
+                    return;
                 }
 
-                if (-1 != req->rb) {
-                    /* write body */
-                    rc = wrap_xsendfile(req, req->written,
-                                        req->r_end[req->rb] - req->written);
-
-                    switch (rc) {
-                        case -1:
-
-                            if (errno == EAGAIN) {
-                                return;
-                            }
-
-                            if (errno == EINTR) {
-                                continue;
-                            }
-
-                            /* fall through */
-                        case 0:
-                            req->state = STATE_CLOSE;
-                            return;
-                        default:
-                            req->written += rc;
-                            req->bc += rc;
-
-                            if (req->written != req->r_end[req->rb]) {
-                                return;
-                            }
-                    }
-
-                    /* prepare for next subheader writeout */
-                    req->rh      = req->rb + 1;
-                    req->rb      = -1;
-                    req->written = 0;
-
-                    if (req->ranges == 1) {
-                        /* single range only */
-                        req->state = STATE_FINISHED;
-                        return;
-                    }
+                if (errno == EINTR) {
+                    continue;
                 }
 
-                break;
+                /* fall through */
+            case 0:
+                req->state = STATE_CLOSE;
+                return;
+        }
+
+        chunk_written(req, rc);
+
+        if (rc != len) {
+            /* socket buffer is full */
+            return;
         }
     }
 }
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+/*
+ * Hierarchical timer wheel, millisecond ticks.  Level l slots cover
+ * 64^l ms each; a timer sits in the lowest level its delta fits in and
+ * is cascaded down a level whenever the wheel enters its slot, so arm,
+ * re-arm and delete are O(1).  wh->now is the next tick to be processed.
+ */
+
+#define WHEEL_MAX ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+uint64_t mono_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(struct WHEEL *wh, uint64_t now)
+{
+    int l, i;
+
+    memset(wh, 0, sizeof(*wh));
+    wh->now = now;
+
+    for (l = 0; l < WHEEL_LEVELS; l++)
+        for (i = 0; i < WHEEL_SIZE; i++) {
+            wh->slot[l][i].next = &wh->slot[l][i];
+            wh->slot[l][i].prev = &wh->slot[l][i];
+        }
+}
+
+static void timer_link(struct WHEEL *wh, struct TIMER *t)
+{
+    struct TIMER *head;
+    uint64_t expires = t->expires, delta;
+    int l;
+
+    if (expires < wh->now) {
+        /* overdue: fire with the next tick */
+        expires = wh->now;
+    }
+
+    delta = expires - wh->now;
+
+    if (delta >= WHEEL_MAX) {
+        expires = wh->now + WHEEL_MAX - 1;
+        delta   = WHEEL_MAX - 1;
+    }
+
+    for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+        if (delta < (uint64_t)1 << (WHEEL_BITS * (l + 1))) {
+            break;
+        }
+    }
+
+    t->level = l;
+    t->slot  = (expires >> (WHEEL_BITS * l)) & WHEEL_MASK;
+    head = &wh->slot[t->level][t->slot];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    wh->mask[t->level] |= (uint64_t)1 << t->slot;
+}
+
+void timer_del(struct WHEEL *wh, struct TIMER *t)
+{
+    if (NULL == t->next) {
+        return;
+    }
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+
+    if (t->next == t->prev) {
+        /* slot is empty now */
+        wh->mask[t->level] &= ~((uint64_t)1 << t->slot);
+    }
+
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* (re)arm, expires is in mono_msec() units */
+void timer_set(struct WHEEL *wh, struct TIMER *t, uint64_t expires)
+{
+    timer_del(wh, t);
+    t->expires = expires;
+    timer_link(wh, t);
+}
+
+/* move all timers of one slot down to the levels they belong to now */
+static int cascade(struct WHEEL *wh, int l)
+{
+    struct TIMER *head, *t, *next;
+    int i = (wh->now >> (WHEEL_BITS * l)) & WHEEL_MASK;
+
+    /* detach the list first, timers may land in this very slot again */
+    head = &wh->slot[l][i];
+
+    if (head->next == head) {
+        return i;
+    }
+
+    t = head->next;
+    head->prev->next = NULL;
+    head->next = head;
+    head->prev = head;
+    wh->mask[l] &= ~((uint64_t)1 << i);
+
+    for (; NULL != t; t = next) {
+        next = t->next;
+        timer_link(wh, t);
+    }
+
+    return i;
+}
+
+/* absolute tick the wheel has work at next, UINT64_MAX if it is empty */
+static uint64_t wheel_due(struct WHEEL *wh)
+{
+    uint64_t due = UINT64_MAX, t, m, block;
+    int l, i, d, shift;
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+        if (0 == wh->mask[l]) {
+            continue;
+        }
+
+        /* distance to the first busy slot, circular */
+        shift = WHEEL_BITS * l;
+        i = (wh->now >> shift) & WHEEL_MASK;
+        m = (wh->mask[l] >> i) | (wh->mask[l] << ((WHEEL_SIZE - i) & WHEEL_MASK));
+        d = __builtin_ctzll(m);
+
+        if (0 == l) {
+            t = wh->now + d;
+        } else {
+            /* upper slots are cascaded when the wheel enters them; the
+             * current one has been done already unless we sit on its
+             * very first tick */
+            block = wh->now >> shift;
+
+            if (0 == d && (block << shift) != wh->now) {
+                d = WHEEL_SIZE;
+            }
+
+            t = (block + d) << shift;
+        }
+
+        if (t < due) {
+            due = t;
+        }
+    }
+
+    return due;
+}
+
+/* run all timers expiring up to (and including) >now< */
+void wheel_run(struct WHEEL *wh, uint64_t now, void (*expire)(void *data, void *arg), void *arg)
+{
+    struct TIMER *head, *t;
+    uint64_t due;
+    int i, l;
+
+    for (;;) {
+        /* jump straight to the next tick with something to do */
+        due = wheel_due(wh);
+
+        if (due > now) {
+            wh->now = now + 1;
+            return;
+        }
+
+        wh->now = due;
+        i = wh->now & WHEEL_MASK;
+
+        /* cascade at slot boundaries, level l+1 only if level l wrapped */
+        if (0 == i) {
+            for (l = 1; l < WHEEL_LEVELS && 0 == cascade(wh, l); l++)
+                ;
+        }
+
+        head = &wh->slot[0][i];
+
+        while (head->next != head) {
+            t = head->next;
+            timer_del(wh, t);
+            expire(t->data, arg);
+        }
+
+        wh->now++;
+    }
+}
+
+/* milliseconds until the wheel has work to do, -1 if it is empty */
+int64_t wheel_next(struct WHEEL *wh, uint64_t now)
+{
+    uint64_t due = wheel_due(wh);
+
+    if (UINT64_MAX == due) {
+        return -1;
+    }
+
+    return due > now ? due - now : 0;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "httpd.h"
+
+/*
+ * Minimal io_uring ring handling on top of the raw syscalls, just what
+ * the io_uring engine in main.c needs (no liburing dependency).
+ */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                          struct io_uring_getevents_arg *arg)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, sizeof(*arg));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/* make sure the kernel knows about all the opcodes we are going to use */
+static int uring_probe(struct URING *ring)
+{
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+        IORING_OP_SPLICE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+    };
+    struct io_uring_probe *probe;
+    size_t size;
+    int i, rc = 0;
+
+    size  = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    probe = malloc(size);
+
+    if (NULL == probe) {
+        return -1;
+    }
+
+    memset(probe, 0, size);
+
+    if (-1 == io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)) {
+        free(probe);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op ||
+            !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            rc = -1;
+        }
+    }
+
+    free(probe);
+    return rc;
+}
+
+int uring_init(struct URING *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    if (-1 == (ring->fd = io_uring_setup(entries, &p))) {
+        return -1;
+    }
+
+    close_on_exec(ring->fd);
+
+    /* older kernels would need separate mappings, may drop cqes and
+     * can't wait with a timeout */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) ||
+        -1 == uring_probe(ring)) {
+        errno = EOPNOTSUPP;
+        goto err;
+    }
+
+    ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+
+    if (ring->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe)) {
+        ring->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (MAP_FAILED == ring->ring) {
+        goto err;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (MAP_FAILED == ring->sqes) {
+        munmap(ring->ring, ring->ring_size);
+        goto err;
+    }
+
+    sq = ring->ring;
+    cq = ring->ring;
+    ring->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->entries  = p.sq_entries;
+    return 0;
+err:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+void uring_exit(struct URING *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* submit everything queued so far, wait for at least >wait< completions
+ * but no longer than >msec< milliseconds (forever if negative) */
+int uring_submit(struct URING *ring, unsigned wait, int64_t msec)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int rc;
+
+    memset(&arg, 0, sizeof(arg));
+
+    if (wait && msec >= 0) {
+        ts.tv_sec  = msec / 1000;
+        ts.tv_nsec = (msec % 1000) * 1000000;
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    rc = io_uring_enter(ring->fd, ring->queued, wait,
+                        IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg);
+
+    if (rc >= 0) {
+        ring->queued -= rc;
+    }
+
+    return rc;
+}
+
+/* get a cleared sqe, flushes the submission queue if it is full */
+struct io_uring_sqe *uring_get_sqe(struct URING *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+        if (-1 == uring_submit(ring, 0, -1)) {
+            return NULL;
+        }
+
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+            return NULL;
+        }
+    }
+
+    sqe = ring->sqes + (tail & ring->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+/* next completion or NULL, release it with uring_cqe_seen() */
+struct io_uring_cqe *uring_peek_cqe(struct URING *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return ring->cqes + (head & ring->cq_mask);
+}
+
+void uring_cqe_seen(struct URING *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#include "httpd.h"
+
+#define WATCH_BUCKETS   1024        /* power of two */
+
+#define WATCH_MASK  (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | \
+                     IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |             \
+                     IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * Change notification for the caches.  The file and listing caches ask
+ * for the directories they cache from to be watched (and everything up
+ * to doc_root, so renaming a parent is seen too).  A watcher thread
+ * turns inotify events into dir_changed()/file_changed() calls, which
+ * drop the affected entries; entries built while watched are served
+ * without any revalidation syscalls until then.
+ *
+ * Every event for a watched directory bumps a generation counter.  A
+ * cache samples it before it looks at the filesystem and only trusts the
+ * entry it builds if no event came in meanwhile, otherwise the entry is
+ * revalidated the old way.  Should the watch limit be reached, or inotify be unavailable or
+ * turned off (-i), entries simply aren't watched.
+ *
+ * Events name a directory by the path it was first watched under, so a
+ * directory is watched under one name only: its canonical one.  Paths
+ * through a symlink (which may be pointed elsewhere without any event
+ * for what lies behind it) or a second name of a directory already
+ * watched aren't, and what is cached under them gets revalidated.
+ */
+
+struct WATCH {
+    int          wd;
+    unsigned int hash;
+    char         *path;             /* with trailing '/' */
+    struct WATCH *pnext;            /* by path */
+    struct WATCH *wnext;            /* by wd */
+};
+
+static pthread_mutex_t lock_watch = PTHREAD_MUTEX_INITIALIZER;
+static struct WATCH    *by_path[WATCH_BUCKETS], *by_wd[WATCH_BUCKETS];
+static int             inotify_fd = -1;
+static char            real_root[PATH_MAX];  /* doc_root, realpath()ed */
+static int             nwatches;
+static unsigned long   generation;
+static pthread_t       watcher;
+
+unsigned long watch_generation(void)
+{
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+/* --- everything below with lock_watch held ---------------------------- */
+
+static struct WATCH *find_path(char *path, unsigned int hash)
+{
+    struct WATCH *w;
+
+    for (w = by_path[hash & (WATCH_BUCKETS - 1)]; NULL != w; w = w->pnext) {
+        if (w->hash == hash && 0 == strcmp(w->path, path)) {
+            return w;
+        }
+    }
+
+    return NULL;
+}
+
+static struct WATCH *find_wd(int wd)
+{
+    struct WATCH *w;
+
+    for (w = by_wd[wd & (WATCH_BUCKETS - 1)]; NULL != w && w->wd != wd; w = w->wnext)
+        ;
+
+    return w;
+}
+
+static void forget(struct WATCH *w)
+{
+    struct WATCH **p;
+
+    for (p = &by_path[w->hash & (WATCH_BUCKETS - 1)]; *p != w; p = &(*p)->pnext)
+        ;
+
+    *p = w->pnext;
+
+    for (p = &by_wd[w->wd & (WATCH_BUCKETS - 1)]; *p != w; p = &(*p)->wnext)
+        ;
+
+    *p = w->wnext;
+    nwatches--;
+    free(w);
+}
+
+/* forget w and drop its watch from the kernel too */
+static void unwatch(struct WATCH *w)
+{
+    inotify_rm_watch(inotify_fd, w->wd);
+    forget(w);
+}
+
+/* forget >path< and everything watched below it, it was moved away */
+static void forget_below(char *path)
+{
+    struct WATCH *w, *next;
+    int i, len = strlen(path);
+
+    for (i = 0; i < WATCH_BUCKETS; i++) {
+        for (w = by_path[i]; NULL != w; w = next) {
+            next = w->pnext;
+
+            if (0 == strncmp(w->path, path, len)) {
+                unwatch(w);
+            }
+        }
+    }
+}
+
+/* is >path< (below doc_root, with trailing '/') free of symlinks? */
+static int canonical(char *path)
+{
+    char real[PATH_MAX], *p = path + strlen(doc_root), *r = real + strlen(real_root);
+    int  len;
+
+    if (NULL == realpath(path, real) || 0 != strncmp(real, real_root, r - real)) {
+        return 0;
+    }
+
+    /* compare the parts below doc_root, without their slashes around */
+    while (*p == '/') {
+        p++;
+    }
+
+    if (*r == '/') {
+        r++;
+    }
+
+    if ((len = strlen(p)) > 0 && p[len - 1] == '/') {
+        len--;
+    }
+
+    return (int) strlen(r) == len && 0 == strncmp(r, p, len);
+}
+
+/* watch a single directory, 0 on success */
+static int add_watch(char *path)
+{
+    struct WATCH *w, *old;
+    unsigned int hash = hash_path(path);
+    int len, wd;
+
+    if (-1 == (wd = inotify_add_watch(inotify_fd, path, WATCH_MASK | IN_ONLYDIR))) {
+        return -1;
+    }
+
+    if (NULL != (w = find_path(path, hash))) {
+        if (w->wd == wd) {
+            return 0;
+        }
+
+        /* the name belongs to another directory by now */
+        unwatch(w);
+    }
+
+    if (NULL != (old = find_wd(wd))) {
+        /* a second name, the wd stays with the first one */
+        return -1;
+    }
+
+    len = strlen(path);
+
+    if (!canonical(path) || NULL == (w = malloc(sizeof(*w) + len + 1))) {
+        /* a name through a symlink, nobody else has this wd */
+        inotify_rm_watch(inotify_fd, wd);
+        return -1;
+    }
+
+    w->wd   = wd;
+    w->hash = hash;
+    w->path = (char *)(w + 1);
+    memcpy(w->path, path, len + 1);
+    w->pnext = by_path[hash & (WATCH_BUCKETS - 1)];
+    by_path[hash & (WATCH_BUCKETS - 1)] = w;
+    w->wnext = by_wd[wd & (WATCH_BUCKETS - 1)];
+    by_wd[wd & (WATCH_BUCKETS - 1)] = w;
+    nwatches++;
+    return 0;
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * Make sure changes in directory >dir< (ending with '/') and its parents
+ * below doc_root get reported.  Returns 0 if so, -1 if not.
+ */
+int watch_dir(char *dir)
+{
+    char path[MAX_PATH + 1];
+    int  len = strlen(dir), full = len, root = strlen(doc_root), rc = 0;
+
+    if (-1 == inotify_fd || len > MAX_PATH || len <= root) {
+        return -1;
+    }
+
+    memcpy(path, dir, len + 1);
+    DO_LOCK(lock_watch);
+
+    /* innermost first, which is checked to still be the directory we
+     * watch, then up to the first one we have already */
+    while (len > root) {
+        path[len] = 0;
+
+        if (len < full && NULL != find_path(path, hash_path(path))) {
+            break;
+        }
+
+        if (0 != add_watch(path)) {
+            rc = -1;
+            break;
+        }
+
+        /* cut the last component, keep its '/' */
+        for (len--; len > 0 && path[len - 1] != '/'; len--)
+            ;
+    }
+
+    DO_UNLOCK(lock_watch);
+    return rc;
+}
+
+/* the listing of dir and of its parent, which shows dir's mtime */
+static void dirs_changed(char *dir)
+{
+    char parent[MAX_PATH + 1];
+    int  len = strlen(dir);
+
+    dir_changed(dir);
+
+    for (len--; len > 0 && dir[len - 1] != '/'; len--)
+        ;
+
+    if (len > 0) {
+        memcpy(parent, dir, len);
+        parent[len] = 0;
+        dir_changed(parent);
+    }
+}
+
+static void handle_event(struct inotify_event *ev)
+{
+    struct WATCH *w;
+    char path[MAX_PATH + 1 + NAME_MAX + 1], *ext;
+    int  len;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* lost events, start over */
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+        flush_dirs();
+        flush_files();
+        return;
+    }
+
+    DO_LOCK(lock_watch);
+
+    if (NULL == (w = find_wd(ev->wd))) {
+        /* not ours (any more), nothing cached depends on it */
+        DO_UNLOCK(lock_watch);
+        return;
+    }
+
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+    len = strlen(w->path);
+    memcpy(path, w->path, len + 1);
+
+    if (ev->mask & IN_IGNORED) {
+        /* directory is gone */
+        forget(w);
+    } else if (ev->mask & IN_MOVE_SELF) {
+        /* the names below it are wrong now */
+        forget_below(path);
+    }
+
+    DO_UNLOCK(lock_watch);
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED) ||
+        (ev->mask & IN_ISDIR && ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        /* a directory moved or vanished, anything cached below it
+         * may have changed its name */
+        flush_dirs();
+        flush_files();
+        return;
+    }
+
+    dirs_changed(path);
+
+    if (ev->len > 0) {
+        strcpy(path + len, ev->name);
+        file_changed(path);
+
+        if (NULL != (ext = strrchr(ev->name, '.')) &&
+            (0 == strcmp(ext, ".gz") || 0 == strcmp(ext, ".br"))) {
+            /* a sidecar: the original's variants changed */
+            path[len + (ext - ev->name)] = 0;
+            file_changed(path);
+        }
+    }
+}
+
+static void *watch_loop(void *arg)
+{
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t rc;
+    char    *p;
+
+    for (;;) {
+        rc = read(inotify_fd, buf, sizeof(buf));
+
+        if (rc <= 0) {
+            if (-1 == rc && EINTR == errno) {
+                continue;
+            }
+
+            fprintf(stderr, "inotify: %s, polling from now on\n", strerror(errno));
+            DO_LOCK(lock_watch);
+            inotify_fd = -1;
+            DO_UNLOCK(lock_watch);
+            __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+            flush_dirs();
+            flush_files();
+            return NULL;
+        }
+
+        for (p = buf; p < buf + rc; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            handle_event(ev);
+        }
+    }
+
+    return NULL;
+}
+
+void init_watch(void)
+{
+    int len;
+
+    if (NULL == realpath(doc_root, real_root)) {
+        fprintf(stderr, "realpath %s: %s, caches poll with stat()\n", doc_root, strerror(errno));
+        return;
+    }
+
+    /* "/" would double the first slash of the paths below it */
+    if ((len = strlen(real_root)) > 0 && real_root[len - 1] == '/') {
+        real_root[len - 1] = 0;
+    }
+
+    if (-1 == (inotify_fd = inotify_init1(IN_CLOEXEC))) {
+        fprintf(stderr, "inotify: %s, caches poll with stat()\n", strerror(errno));
+        return;
+    }
+
+    if (0 != pthread_create(&watcher, NULL, watch_loop, NULL)) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+void watch_stats(char *buf, int size)
+{
+    DO_LOCK(lock_watch);
+    snprintf(buf, size, "%d directories watched, %lu events",
+             nwatches, watch_generation());
+    DO_UNLOCK(lock_watch);
+}